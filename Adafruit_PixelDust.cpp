@@ -28,288 +28,3188 @@
 
 #include "Adafruit_PixelDust.h"
 
+#ifdef PIXELDUST_THREADS
+#include <pthread.h>
+#include <time.h>
+#elif defined(PIXELDUST_STATS) && !defined(ARDUINO)
+#include <time.h>
+#endif
+
+// SIMD velocity pass is used with the structure-of-arrays layout only
+#if defined(PIXELDUST_SOA) && !defined(PIXELDUST_FIXED_POINT)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_AVX2 ///< Use AVX2 velocity pass
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_SSE2 ///< Use SSE2 velocity pass
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SIMD_NEON ///< Use NEON velocity pass
+#endif
+#endif
+
+// Grain data accessors, so the same code works with either layout
+#ifdef PIXELDUST_SOA
+#define GX(i) gx[i]   ///< Grain i horizontal position
+#define GY(i) gy[i]   ///< Grain i vertical position
+#define GVX(i) gvx[i] ///< Grain i horizontal velocity
+#define GVY(i) gvy[i] ///< Grain i vertical velocity
+#else
+#define GX(i) grain[i].x   ///< Grain i horizontal position
+#define GY(i) grain[i].y   ///< Grain i vertical position
+#define GVX(i) grain[i].vx ///< Grain i horizontal velocity
+#define GVY(i) grain[i].vy ///< Grain i vertical velocity
+#endif
+
+#define GRAIN_ASLEEP 0xFF ///< rest[] value for a sleeping grain
+
+/*! Bytes of position & velocity data per grain, in either layout */
+#define GRAIN_BYTES (2 * sizeof(position_t) + 2 * sizeof(velocity_t))
+
+#ifdef PIXELDUST_COMPACT
+// With 16-bit positions, the largest coordinate (127 * 256 + 255) plus a
+// full pixel of velocity must still fit, as on AVR
+#define COMPACT_FITS ((width <= 127) && (height <= 127)) ///< Grid size OK
+#endif
+
+// moveGrain() result bits
+#define MOVE_CHANGED 0x01 ///< Grain moved to a different pixel
+#define MOVE_WALL 0x02    ///< Grain hit an edge of the playfield
+#define MOVE_BLOCKED 0x04 ///< Grain's next pixel was occupied
+#define MOVE_SKID 0x08    ///< Blocked diagonally, slid along one axis
+
+#define TILE_SHIFT 3  ///< Occupancy summary nodes are 8x8 of level below
+#define TILE_LEVELS 6 ///< Summary levels + 1, enough for 32767x32767
+
+#ifdef PIXELDUST_SPARSE
+#define BLOCK_MASK ((1 << PIXELDUST_BLOCK_SHIFT) - 1) ///< Pixel within block
+#define BLOCK_BYTES (PIXELDUST_BLOCK_WORDS * sizeof(bitmap_word_t)) ///< Size
+#endif
+
+#ifndef __AVR__
+
+// Occupancy summary, see enableTiles().  Level 1 counts the set pixels in
+// each 8x8 pixel tile, level 2 in each 8x8 group of tiles (64x64 pixels),
+// and so on up to the top level, one node covering the whole grid.  A node
+// with a count of 0 is empty, and one with a count equal to its area (less
+// than 64^level along the right and bottom edges) is full.  Queries walk
+// down from the top, skipping empty or full nodes.  Without the summary
+// they work the same way, only counting each tile's pixels as they go.
+struct Adafruit_PixelDust_Tiles {
+  uint8_t levels;                   // Top level, 1 to TILE_LEVELS - 1
+  dimension_t cols[TILE_LEVELS],    // Nodes per row at each level
+      rows[TILE_LEVELS];            // Nodes per column at each level
+  uint8_t *tile;                    // Level 1 counts (0-64)
+  uint32_t *count[TILE_LEVELS];     // Level 2 and up counts, one alloc
+};
+
+// Top summary level for a w x h grid (whether or not a summary is kept)
+static uint8_t topLevel(dimension_t w, dimension_t h) {
+  uint8_t level = 1;
+  while (((w - 1) | (h - 1)) >> (level * TILE_SHIFT))
+    level++;
+  return level;
+}
+
+// Set pixel count of one node
+static inline uint32_t nodeCount(const Adafruit_PixelDust_Tiles *t,
+                                 uint8_t level, dimension_t nx,
+                                 dimension_t ny) {
+  size_t i = (size_t)ny * t->cols[level] + nx;
+  return (level == 1) ? t->tile[i] : t->count[level][i];
+}
+
+// Add n to the count of the node holding pixel (x, y) at one level.  When
+// multithreaded, bands of the grid (see iterateThreaded()) share nodes,
+// so counts are then updated atomically.
+static inline void nodeAdd(Adafruit_PixelDust_Tiles *t, uint8_t level,
+                           dimension_t x, dimension_t y, int8_t n,
+                           bool shared) {
+  uint8_t s = level * TILE_SHIFT;
+  size_t i = (size_t)(y >> s) * t->cols[level] + (x >> s);
+#ifdef PIXELDUST_THREADS
+  if (shared) {
+    if (level == 1)
+      __atomic_fetch_add(&t->tile[i], (uint8_t)n, __ATOMIC_RELAXED);
+    else
+      __atomic_fetch_add(&t->count[level][i], (uint32_t)(int32_t)n,
+                         __ATOMIC_RELAXED);
+    return;
+  }
+#else
+  (void)shared;
+#endif
+  if (level == 1)
+    t->tile[i] += n;
+  else
+    t->count[level][i] += n;
+}
+
+static void freeTiles(Adafruit_PixelDust_Tiles *t) {
+  free(t->tile);
+  free(t->count[2]);
+  delete t;
+}
+
+#endif // !__AVR__
+
+#ifdef PIXELDUST_STATS
+
+// Stats history, see enableStats().  Other threads read it without
+// locking: each slot in the ring starts with a sequence number that's odd
+// while the slot is being written, and a reader retries if it changed
+// during its copy (a "seqlock").  Stats are stored as 32-bit words so
+// every access can be atomic.
+struct Adafruit_PixelDust_Stats {
+  PixelDustStats cur; // Frame being recorded
+  uint32_t mark;      // Time at start of the current phase
+  uint32_t head;      // Frames recorded
+  uint16_t size;      // Number of slots in ring
+  uint32_t *ring;     // Slots of 1 + STATS_WORDS words: sequence, stats
+};
+
+/*! 32-bit words per PixelDustStats in the history */
+#define STATS_WORDS ((sizeof(PixelDustStats) + 3) / 4)
+
+// Without threads, no atomics are needed (or available on all targets)
+#ifdef PIXELDUST_THREADS
+#define STATS_LOAD(p, o) __atomic_load_n(p, o)        ///< Load word
+#define STATS_STORE(p, v, o) __atomic_store_n(p, v, o) ///< Store word
+#define STATS_FENCE(o) __atomic_thread_fence(o)        ///< Memory fence
+#else
+#define STATS_LOAD(p, o) (*(p))            ///< Load word
+#define STATS_STORE(p, v, o) (*(p) = (v)) ///< Store word
+#define STATS_FENCE(o)                    ///< Memory fence
+#endif
+
+// Current time for phase timings in nanoseconds, wraps every 4 seconds
+static uint32_t statsNow(void) {
+#ifdef ARDUINO
+  return micros() * 1000;
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint32_t)t.tv_sec * 1000000000UL + t.tv_nsec;
+#endif
+}
+
+// Set *t to the time since the current phase started, start the next one
+static void statsMark(Adafruit_PixelDust_Stats *s, uint32_t *t) {
+  uint32_t now = statsNow();
+  *t = now - s->mark;
+  s->mark = now;
+}
+
+/*! End a phase of step(), if recording stats */
+#define STATS_MARK(phase)                                                      \
+  do {                                                                         \
+    if (stats)                                                                 \
+      statsMark(stats, &stats->cur.phase);                                     \
+  } while (0)
+/*! Finish the frame, if recording stats */
+#define STATS_RECORD()                                                         \
+  do {                                                                         \
+    if (stats)                                                                 \
+      recordStats();                                                           \
+  } while (0)
+/*! Tally a moveGrain() result in a count array */
+#define COUNT_MOVE(count, m) (count)[m]++
+
+#else
+
+#define STATS_MARK(phase)       ///< Not recording stats
+#define STATS_RECORD()          ///< Not recording stats
+#define COUNT_MOVE(count, m) (void)(m) ///< Not counting moves
+
+#endif // PIXELDUST_STATS
+
 Adafruit_PixelDust::Adafruit_PixelDust(dimension_t w, dimension_t h,
                                        grain_count_t n, uint8_t s, uint8_t e,
                                        bool sort)
-    : width(w), height(h), w8((w + 7) / 8), xMax(w * 256 - 1),
-      yMax(h * 256 - 1), n_grains(n), scale(s), elasticity(e), bitmap(NULL),
-      grain(NULL), sort(sort) {}
+    : width(w), height(h),
+      stride((w + PIXELDUST_WORD_BITS - 1) / PIXELDUST_WORD_BITS),
+      xMax(w * 256 - 1), yMax(h * 256 - 1), n_grains(n), scale(s),
+      elasticity(e),
+      sortOctant(0xFF), bitmap(NULL), order(NULL), sortBuf(NULL),
+      grainMap(NULL), changes(NULL), nChanges(0), rest(NULL), active(NULL),
+      nActive(0), sleepFrames(0), sleepAx(0), sleepAy(0), sleepDir(0xFF),
+      material(NULL), materials(NULL), nMaterials(0), merged(NULL),
+      mergeSlot(NULL), stepPeriod(1000000L / 45), stepTime(0), maxSteps(8),
+      sort(sort), attached(false) {
+#ifdef PIXELDUST_SOA
+  gx = gy = NULL;
+  gvx = gvy = NULL;
+#else
+  grain = NULL;
+#endif
+#ifdef PIXELDUST_SPARSE
+  block = NULL;
+  blockCols = (w + BLOCK_MASK) >> PIXELDUST_BLOCK_SHIFT;
+#elif !defined(__AVR__)
+  row = NULL;
+#endif
+#ifndef __AVR__
+  tiles = NULL;
+#endif
+#ifdef PIXELDUST_THREADS
+  workers = NULL;
+  runner = NULL;
+#endif
+#ifdef PIXELDUST_STATS
+  stats = NULL;
+#endif
+}
 
 Adafruit_PixelDust::~Adafruit_PixelDust(void) {
+#ifdef PIXELDUST_THREADS
+  stopRunner();
+  setThreads(1); // Stop worker threads, if any
+#endif
+#ifdef PIXELDUST_STATS
+  enableStats(0); // Free stats history, if any
+#endif
   if (bitmap) {
-    free(bitmap);
+#ifdef PIXELDUST_SPARSE
+    freeBlocks();
+#elif !defined(__AVR__)
+    if (attached)
+      free(row); // Separate from bitmap when attached, see attachSnapshot()
+#endif
+    if (!attached)
+      free(bitmap);
     bitmap = NULL;
   }
-  if (grain) {
-    free(grain);
-    grain = NULL;
+  freeGrains();
+  if (order) {
+    free(order);
+    order = NULL;
+    free(sortBuf);
+    sortBuf = NULL;
+  }
+  if (grainMap) {
+    free(grainMap);
+    grainMap = NULL;
+  }
+  if (changes) {
+    free(changes);
+    changes = NULL;
+  }
+  if (rest) {
+    free(rest);
+    rest = NULL;
+    free(active);
+    active = NULL;
   }
+  if (materials) {
+    free(material);
+    material = NULL;
+    free(materials);
+    materials = NULL;
+  }
+  if (merged) {
+    free(merged);
+    merged = NULL;
+    free(mergeSlot);
+    mergeSlot = NULL;
+  }
+#ifndef __AVR__
+  if (tiles) {
+    freeTiles(tiles);
+    tiles = NULL;
+  }
+#endif
 }
 
 bool Adafruit_PixelDust::begin(void) {
   if ((bitmap))
     return true; // Already allocated
-  if ((bitmap = (uint8_t *)calloc(w8 * height, sizeof(uint8_t)))) {
-    if ((!n_grains) || (grain = (Grain *)calloc(n_grains, sizeof(Grain))))
+#ifdef PIXELDUST_COMPACT
+  if (!COMPACT_FITS)
+    return false; // Too big for 16-bit positions
+#endif
+#if defined(__AVR__)
+  if ((bitmap = (bitmap_word_t *)calloc(stride * height, 1))) {
+#elif defined(PIXELDUST_SPARSE)
+  // Shared empty & full blocks, then the block directory, all blocks
+  // initially pointing to the empty one
+  size_t blocks =
+      (size_t)blockCols * ((height + BLOCK_MASK) >> PIXELDUST_BLOCK_SHIFT);
+  if ((bitmap = (bitmap_word_t *)calloc(
+           1, 2 * PIXELDUST_BLOCK_WORDS * sizeof(bitmap_word_t) +
+                  blocks * sizeof(bitmap_word_t *)))) {
+    memset(&bitmap[PIXELDUST_BLOCK_WORDS], 0xFF,
+           PIXELDUST_BLOCK_WORDS * sizeof(bitmap_word_t));
+    block = (bitmap_word_t **)&bitmap[2 * PIXELDUST_BLOCK_WORDS];
+    for (size_t i = 0; i < blocks; i++)
+      block[i] = bitmap;
+#else
+  // Row pointers follow the bitmap in the same allocation
+  size_t words = (size_t)stride * height;
+  size_t bytes = words * sizeof(bitmap_word_t) +
+                 height * sizeof(bitmap_word_t *);
+  if ((bitmap = (bitmap_word_t *)calloc(1, bytes))) {
+    row = (bitmap_word_t **)&bitmap[words];
+    for (dimension_t y = 0; y < height; y++)
+      row[y] = &bitmap[(size_t)y * stride];
+#endif
+    if ((!n_grains) || allocGrains())
       return true; // Success
-    free(bitmap);  // Second alloc failed; free first-alloc data too
+    free(bitmap);  // Later alloc failed; free first-alloc data too
     bitmap = NULL;
   }
   return false; // You LOSE, good DAY sir!
 }
 
+// Allocate grain data in whichever layout is in use, plus anything
+// needed for sorting.  On failure, frees anything it allocated.  Grains
+// start out unplaced, with X position -1: still pixel 0 when divided by
+// 256, but distinguishable from a grain actually placed there.
+bool Adafruit_PixelDust::allocGrains(void) {
+#ifdef PIXELDUST_SOA
+  // All four arrays in one block, positions first for alignment
+  if ((gx = (position_t *)calloc(n_grains, GRAIN_BYTES))) {
+    gy = &gx[n_grains];
+    gvx = (velocity_t *)&gy[n_grains];
+    gvy = &gvx[n_grains];
+#else
+  if ((grain = (Grain *)calloc(n_grains, sizeof(Grain)))) {
+#endif
+    for (grain_count_t i = 0; i < n_grains; i++)
+      GX(i) = -1;
+    if (allocSort())
+      return true;
+    freeGrains();
+  }
+  return false;
+}
+
+// If sorting, allocate the grain order list (initially in index order)
+// and, except on AVR, merge space, see sortGrains().  Returns false if
+// memory could not be allocated.
+bool Adafruit_PixelDust::allocSort(void) {
+  if (!sort || order || !n_grains)
+    return true; // Not needed or already done
+  if (!(order = (grain_count_t *)malloc(n_grains * sizeof(grain_count_t))))
+    return false;
+#ifndef __AVR__
+  if (!(sortBuf = (grain_count_t *)malloc((n_grains + 4) *
+                                          sizeof(grain_count_t)))) {
+    free(order);
+    order = NULL;
+    return false;
+  }
+#endif
+  for (grain_count_t i = 0; i < n_grains; i++)
+    order[i] = i;
+  sortOctant = 0xFF; // Full sort on next iterate()
+  return true;
+}
+
+// Free grain data (not sorting scratch space), unless it's in an attached
+// snapshot
+void Adafruit_PixelDust::freeGrains(void) {
+#ifdef PIXELDUST_SOA
+  if (gx && !attached)
+    free(gx); // Other grain arrays are in the same block
+  gx = gy = NULL;
+  gvx = gvy = NULL;
+#else
+  if (grain && !attached)
+    free(grain);
+  grain = NULL;
+#endif
+}
+
 bool Adafruit_PixelDust::setPosition(grain_count_t i, dimension_t x,
                                      dimension_t y) {
   if (getPixel(x, y))
     return false; // Position already occupied
-  setPixel(x, y);
-  grain[i].x = x * 256;
-  grain[i].y = y * 256;
+#ifdef PIXELDUST_SPARSE
+  if (!writeWord(x, y))
+    return false; // Block couldn't be allocated
+#endif
+  setBit(x, y);
+#ifndef __AVR__
+  if (tiles)
+    addTiles(x, y, 1);
+#endif
+  if (grainMap)
+    grainMap[y * width + x] = i;
+  GX(i) = x * 256;
+  GY(i) = y * 256;
+  if (rest && (rest[i] == GRAIN_ASLEEP)) {
+    rest[i] = 0;
+    active[nActive++] = i;
+  }
   return true;
 }
 
 void Adafruit_PixelDust::getPosition(grain_count_t i, dimension_t *x,
                                      dimension_t *y) const {
-  *x = grain[i].x / 256;
-  *y = grain[i].y / 256;
+  *x = GX(i) / 256;
+  *y = GY(i) / 256;
 }
 
-// Fill grain structures with random positions, making sure no two are
-// in the same location.
-void Adafruit_PixelDust::randomize(void) {
+bool Adafruit_PixelDust::enableGrainMap(void) {
+  if (!bitmap || (n_grains > PIXELDUST_OBSTACLE))
+    return false;
+  if (!grainMap &&
+      !(grainMap = (grain_count_t *)malloc((size_t)width * height *
+                                           sizeof(grain_count_t))))
+    return false;
+  // Anything set in the bitmap is an obstacle, unless a grain is there
+  dimension_t x, y;
+  for (y = 0; y < height; y++) {
+    for (x = 0; x < width; x++)
+      grainMap[y * width + x] =
+          getPixel(x, y) ? PIXELDUST_OBSTACLE : PIXELDUST_EMPTY;
+  }
   for (grain_count_t i = 0; i < n_grains; i++) {
-    while (!setPosition(i, random(width), random(height)))
-      ;
+    if (GX(i) < 0)
+      continue; // Not placed yet (see allocGrains())
+    x = GX(i) / 256;
+    y = GY(i) / 256;
+    if (getPixel(x, y)) // Skip grains whose pixels were clear()ed
+      grainMap[y * width + x] = i;
   }
+  return true;
 }
 
-// Pixel set/read functions for the bitmap buffer
+bool Adafruit_PixelDust::enableSleep(uint8_t frames) {
+  if (!frames || (frames >= GRAIN_ASLEEP) || !enableGrainMap() ||
+      !enableChanges())
+    return false;
+  if (!rest) {
+    if (!(rest = (uint8_t *)malloc(n_grains + 1)))
+      return false;
+    if (!(active = (grain_count_t *)malloc((n_grains + 1) *
+                                           sizeof(grain_count_t)))) {
+      free(rest);
+      rest = NULL;
+      return false;
+    }
+  }
+  sleepFrames = frames;
+  wakeAll();
+  return true;
+}
 
-#ifdef __AVR__
+// Wake all grains
+void Adafruit_PixelDust::wakeAll(void) {
+  memset(rest, 0, n_grains);
+  for (nActive = 0; nActive < n_grains; nActive++)
+    active[nActive] = nActive;
+}
 
-// Shift-by-N operations are costly on AVR, so table lookups are used.
+// Wake any sleeping grains in the 3x3 pixels centered on (x, y)
+void Adafruit_PixelDust::wakeAround(dimension_t x, dimension_t y) {
+  dimension_t x0 = x ? x - 1 : 0, x1 = (x < width - 1) ? x + 1 : x,
+              y0 = y ? y - 1 : 0, y1 = (y < height - 1) ? y + 1 : y;
+  for (y = y0; y <= y1; y++) {
+    for (x = x0; x <= x1; x++) {
+      grain_count_t g = grainMap[y * width + x];
+      if ((g < PIXELDUST_OBSTACLE) && (rest[g] == GRAIN_ASLEEP)) {
+        rest[g] = 0;
+        active[nActive++] = g;
+      }
+    }
+  }
+}
 
-static const uint8_t PROGMEM clr[] = {~0x80, ~0x40, ~0x20, ~0x10,
-                                      ~0x08, ~0x04, ~0x02, ~0x01},
-                             set[] = {0x80, 0x40, 0x20, 0x10,
-                                      0x08, 0x04, 0x02, 0x01};
+// Wake sleeping grains next to any pixel vacated in the last iterate()
+void Adafruit_PixelDust::wakeChanged(void) {
+  for (grain_count_t k = 0; (k < nChanges) && (nActive < n_grains); k++)
+    wakeAround(changes[k].oldX, changes[k].oldY);
+}
 
-void Adafruit_PixelDust::setPixel(dimension_t x, dimension_t y) {
-  bitmap[y * w8 + x / 8] |= pgm_read_byte(&set[x & 7]);
+// True if a grain at (x, y) can't fall any further: the pixel (or for a
+// diagonal, all three pixels) toward gravity when grains last woke is
+// occupied or off the grid.  Grains creeping across a pixel a fraction at
+// a time would otherwise fall asleep in mid-air, see moveGrain().
+bool Adafruit_PixelDust::supported(dimension_t x, dimension_t y) const {
+  static const int8_t dx[] = {1, 1, 0, -1, -1, -1, 0, 1},
+                      dy[] = {0, 1, 1, 1, 0, -1, -1, -1};
+  if (sleepDir > 7)
+    return true; // No gravity, anywhere will do
+  int8_t sx = dx[sleepDir], sy = dy[sleepDir];
+  bool xEdge = sx && ((sx < 0) ? !x : (x >= width - 1)),
+       yEdge = sy && ((sy < 0) ? !y : (y >= height - 1));
+  if (sx && !xEdge && !getPixel(x + sx, y))
+    return false;
+  if (sy && !yEdge && !getPixel(x, y + sy))
+    return false;
+  return xEdge || yEdge || !sx || !sy || getPixel(x + sx, y + sy);
 }
 
-void Adafruit_PixelDust::clearPixel(dimension_t x, dimension_t y) {
-  bitmap[y * w8 + x / 8] &= pgm_read_byte(&clr[x & 7]);
+bool Adafruit_PixelDust::setMaterials(const GrainMaterial *table,
+                                      uint8_t n) {
+  if (!n || (n > PIXELDUST_MAX_MATERIALS))
+    return false;
+  if (!materials &&
+      !(materials = (GrainMaterial *)malloc(PIXELDUST_MAX_MATERIALS *
+                                            sizeof(GrainMaterial))))
+    return false;
+  if (!material && n_grains && !(material = (uint8_t *)calloc(n_grains, 1)))
+    return false;
+  memcpy(materials, table, n * sizeof(GrainMaterial));
+  if (material && (n < nMaterials)) {
+    for (grain_count_t i = 0; i < n_grains; i++) {
+      if (material[i] >= n)
+        material[i] = 0;
+    }
+  }
+  nMaterials = n;
+  return true;
 }
 
-bool Adafruit_PixelDust::getPixel(dimension_t x, dimension_t y) const {
-  return bitmap[y * w8 + x / 8] & pgm_read_byte(&set[x & 7]);
+bool Adafruit_PixelDust::enableChanges(void) {
+  nChanges = 0;
+  return changes || !n_grains ||
+         (changes = (GrainChange *)malloc(n_grains * sizeof(GrainChange)));
 }
 
-#else
+grain_count_t Adafruit_PixelDust::getGrainAt(dimension_t x,
+                                             dimension_t y) const {
+  if (grainMap)
+    return grainMap[y * width + x];
+  if (!getPixel(x, y))
+    return PIXELDUST_EMPTY;
+  // No map, search for a grain there
+  for (grain_count_t i = 0; i < n_grains; i++) {
+    if ((GX(i) >= 0) && (GX(i) / 256 == x) && (GY(i) / 256 == y))
+      return i; // Placed grain there (see allocGrains())
+  }
+  return PIXELDUST_OBSTACLE;
+}
 
-// Most other architectures will perform better with shifts.
+#ifndef __AVR__
 
-void Adafruit_PixelDust::setPixel(dimension_t x, dimension_t y) {
-  bitmap[y * w8 + x / 8] |= (0x80 >> (x & 7));
+bool Adafruit_PixelDust::enableTiles(void) {
+  if (!bitmap)
+    return false;
+  if (!tiles) {
+    Adafruit_PixelDust_Tiles *t = new Adafruit_PixelDust_Tiles();
+    size_t upper = 1; // +1 so never 0 bytes
+    uint8_t level;
+    t->levels = topLevel(width, height);
+    for (level = 1; level <= t->levels; level++) {
+      t->cols[level] = ((width - 1) >> (level * TILE_SHIFT)) + 1;
+      t->rows[level] = ((height - 1) >> (level * TILE_SHIFT)) + 1;
+      if (level > 1)
+        upper += (size_t)t->cols[level] * t->rows[level];
+    }
+    t->tile = (uint8_t *)malloc((size_t)t->cols[1] * t->rows[1]);
+    t->count[2] = (uint32_t *)malloc(upper * sizeof(uint32_t));
+    if (!t->tile || !t->count[2]) {
+      freeTiles(t);
+      return false;
+    }
+    for (level = 3; level <= t->levels; level++)
+      t->count[level] = &t->count[level - 1][(size_t)t->cols[level - 1] *
+                                             t->rows[level - 1]];
+    tiles = t;
+  }
+  countTiles(0, 0, width, height);
+  return true;
 }
 
-void Adafruit_PixelDust::clearPixel(dimension_t x, dimension_t y) {
-  bitmap[y * w8 + x / 8] &= (0x7F7F >> (x & 7));
+// Pixels x to x+7 (x a multiple of 8) of bitmap row y, leftmost in the MSB
+uint8_t Adafruit_PixelDust::tileBits(dimension_t x, dimension_t y) const {
+  return *readWord(x, y) >>
+         (PIXELDUST_WORD_BITS - 8 - x % PIXELDUST_WORD_BITS);
 }
 
-bool Adafruit_PixelDust::getPixel(dimension_t x, dimension_t y) const {
-  return bitmap[y * w8 + x / 8] & (0x80 >> (x & 7));
+// Recount all summary nodes overlapping pixels x0 to x1-1, y0 to y1-1
+void Adafruit_PixelDust::countTiles(dimension_t x0, dimension_t y0,
+                                    dimension_t x1, dimension_t y1) {
+  Adafruit_PixelDust_Tiles *t = tiles;
+  uint32_t nx, ny, cx, cy, y;
+  for (ny = y0 >> TILE_SHIFT; ny <= (y1 - 1U) >> TILE_SHIFT; ny++) {
+    uint32_t yEnd = (ny + 1) << TILE_SHIFT;
+    if (yEnd > height)
+      yEnd = height;
+    for (nx = x0 >> TILE_SHIFT; nx <= (x1 - 1U) >> TILE_SHIFT; nx++) {
+      uint8_t n = 0;
+      for (y = ny << TILE_SHIFT; y < yEnd; y++)
+        n += __builtin_popcount(tileBits(nx << TILE_SHIFT, y));
+      t->tile[ny * t->cols[1] + nx] = n;
+    }
+  }
+  for (uint8_t level = 2; level <= t->levels; level++) {
+    uint8_t s = level * TILE_SHIFT;
+    for (ny = y0 >> s; ny <= (y1 - 1U) >> s; ny++) {
+      for (nx = x0 >> s; nx <= (x1 - 1U) >> s; nx++) {
+        uint32_t n = 0;
+        for (cy = ny << TILE_SHIFT;
+             (cy < (ny + 1) << TILE_SHIFT) && (cy < t->rows[level - 1]);
+             cy++) {
+          for (cx = nx << TILE_SHIFT;
+               (cx < (nx + 1) << TILE_SHIFT) && (cx < t->cols[level - 1]);
+               cx++)
+            n += nodeCount(t, level - 1, cx, cy);
+        }
+        t->count[level][ny * t->cols[level] + nx] = n;
+      }
+    }
+  }
 }
 
-#endif // !__AVR__
+// Add n to every summary node holding pixel (x, y)
+void Adafruit_PixelDust::addTiles(dimension_t x, dimension_t y, int8_t n) {
+  bool shared = false;
+#ifdef PIXELDUST_THREADS
+  shared = (workers != NULL);
+#endif
+  for (uint8_t level = 1; level <= tiles->levels; level++)
+    nodeAdd(tiles, level, x, y, n, shared);
+}
 
-// Clears bitmap buffer.  Grain positions are unchanged,
-// probably want to follow up with some place() calls.
-void Adafruit_PixelDust::clear(void) {
-  if (bitmap)
-    memset(bitmap, 0, w8 * height);
+// A grain moved from (ox, oy) to (nx, ny), in different tiles.  Counts
+// change only at levels where the two pixels are in different nodes.
+void Adafruit_PixelDust::moveTiles(dimension_t ox, dimension_t oy,
+                                   dimension_t nx, dimension_t ny) {
+  bool shared = false;
+#ifdef PIXELDUST_THREADS
+  shared = (workers != NULL);
+#endif
+  for (uint8_t level = 1; (level <= tiles->levels) &&
+                          (((ox ^ nx) | (oy ^ ny)) >> (level * TILE_SHIFT));
+       level++) {
+    nodeAdd(tiles, level, ox, oy, -1, shared);
+    nodeAdd(tiles, level, nx, ny, 1, shared);
+  }
 }
 
-#define BOUNCE(n) n = ((-n) * elasticity / 256) ///< 1-axis elastic bounce
+// Count set pixels in a rectangle, clipped to the grid
+uint32_t Adafruit_PixelDust::countSet(dimension_t x, dimension_t y,
+                                      dimension_t w, dimension_t h) const {
+  if ((x >= width) || (y >= height) || !w || !h)
+    return 0;
+  uint32_t x1 = (uint32_t)x + w, y1 = (uint32_t)y + h;
+  return countIn(tiles ? tiles->levels : topLevel(width, height), 0, 0, x,
+                 y, (x1 > width) ? width : x1, (y1 > height) ? height : y1);
+}
 
-// Comparison functions for qsort().  Rather than using true position along
-// acceleration vector (which would be computationally expensive), an 8-way
-// approximation is 'good enough' and quick to compute.  A separate optimized
-// function is provided for each of the 8 directions.
+// Count set pixels in the part of pixels x0 to x1-1, y0 to y1-1 (within
+// the grid) covered by one summary node
+uint32_t Adafruit_PixelDust::countIn(uint8_t level, dimension_t nx,
+                                     dimension_t ny, dimension_t x0,
+                                     dimension_t y0, dimension_t x1,
+                                     dimension_t y1) const {
+  uint8_t s = level * TILE_SHIFT;
+  uint32_t ax0 = (uint32_t)nx << s, ay0 = (uint32_t)ny << s,
+           ax1 = ax0 + (1UL << s), ay1 = ay0 + (1UL << s), n;
+  if (ax1 > width)
+    ax1 = width;
+  if (ay1 > height)
+    ay1 = height;
+  // Overlap of node and rectangle
+  uint32_t ix0 = (x0 > ax0) ? x0 : ax0, ix1 = (x1 < ax1) ? x1 : ax1,
+           iy0 = (y0 > ay0) ? y0 : ay0, iy1 = (y1 < ay1) ? y1 : ay1;
+  if ((ix0 >= ix1) || (iy0 >= iy1))
+    return 0;
+  uint32_t area = (ix1 - ix0) * (iy1 - iy0);
+  if (tiles) {
+    if (!(n = nodeCount(tiles, level, nx, ny)))
+      return 0; // Node is empty
+    if (n == (ax1 - ax0) * (ay1 - ay0))
+      return area; // Node is full
+    if (area == (ax1 - ax0) * (ay1 - ay0))
+      return n; // Node is entirely within rectangle
+  }
+  n = 0;
+  if (level == 1) {
+    uint8_t mask = (0xFF >> (ix0 - ax0)) & (0xFF << (ax0 + 8 - ix1));
+    for (uint32_t y = iy0; y < iy1; y++)
+      n += __builtin_popcount(tileBits(ax0, y) & mask);
+    return n;
+  }
+  s -= TILE_SHIFT; // Child level
+  for (uint32_t cy = iy0 >> s; cy <= (iy1 - 1) >> s; cy++) {
+    for (uint32_t cx = ix0 >> s; cx <= (ix1 - 1) >> s; cx++)
+      n += countIn(level - 1, cx, cy, ix0, iy0, ix1, iy1);
+  }
+  return n;
+}
 
-static int compare0(const void *a, const void *b) {
-  return ((Grain *)b)->x - ((Grain *)a)->x;
+uint32_t Adafruit_PixelDust::countFree(dimension_t x, dimension_t y,
+                                       dimension_t w, dimension_t h) const {
+  if ((x >= width) || (y >= height))
+    return 0;
+  if (w > width - x)
+    w = width - x;
+  if (h > height - y)
+    h = height - y;
+  return (uint32_t)w * h - countSet(x, y, w, h);
 }
-static int compare1(const void *a, const void *b) {
-  return ((Grain *)b)->x + ((Grain *)b)->y - ((Grain *)a)->x - ((Grain *)a)->y;
+
+bool Adafruit_PixelDust::findFree(dimension_t x, dimension_t y,
+                                  dimension_t *fx, dimension_t *fy) const {
+  uint32_t best = 0xFFFFFFFF; // Squared distance of nearest free pixel
+  findIn(tiles ? tiles->levels : topLevel(width, height), 0, 0, x, y, &best,
+         fx, fy);
+  return best != 0xFFFFFFFF;
 }
-static int compare2(const void *a, const void *b) {
-  return ((Grain *)b)->y - ((Grain *)a)->y;
+
+// Search one summary node for a free pixel nearer to (x, y) than *best
+// (squared distance), updating *best, *fx and *fy if one is found.
+// Children are searched nearest first, so later ones are mostly skipped.
+void Adafruit_PixelDust::findIn(uint8_t level, dimension_t nx,
+                                dimension_t ny, dimension_t x, dimension_t y,
+                                uint32_t *best, dimension_t *fx,
+                                dimension_t *fy) const {
+  uint8_t s = level * TILE_SHIFT;
+  uint32_t ax0 = (uint32_t)nx << s, ay0 = (uint32_t)ny << s,
+           ax1 = ax0 + (1UL << s), ay1 = ay0 + (1UL << s);
+  if (ax1 > width)
+    ax1 = width;
+  if (ay1 > height)
+    ay1 = height;
+  // Distance from (x, y) to nearest pixel of node
+  uint32_t dx = (x < ax0) ? ax0 - x : (x >= ax1) ? x - ax1 + 1 : 0,
+           dy = (y < ay0) ? ay0 - y : (y >= ay1) ? y - ay1 + 1 : 0;
+  if ((dx * dx + dy * dy >= *best) ||
+      (tiles && (nodeCount(tiles, level, nx, ny) ==
+                 (ax1 - ax0) * (ay1 - ay0)))) // Too far, or full
+    return;
+  if (level == 1) {
+    for (uint32_t py = ay0; py < ay1; py++) {
+      uint8_t free = ~tileBits(ax0, py) & (0xFF << (ax0 + 8 - ax1));
+      dy = (py > y) ? py - y : y - py;
+      while (free) {
+        uint8_t b = __builtin_clz(free) - 24; // Leftmost free pixel
+        uint32_t px = ax0 + b, d;
+        free &= ~(0x80 >> b);
+        dx = (px > x) ? px - x : x - px;
+        if ((d = dx * dx + dy * dy) < *best) {
+          *best = d;
+          *fx = px;
+          *fy = py;
+        }
+      }
+    }
+    return;
+  }
+  // Children in rings around the one nearest (x, y)
+  s -= TILE_SHIFT;
+  int32_t cx0 = nx << TILE_SHIFT, cy0 = ny << TILE_SHIFT,
+          cx1 = (ax1 - 1) >> s, cy1 = (ay1 - 1) >> s, // Last child
+      cx = x >> s, cy = y >> s;
+  cx = (cx < cx0) ? cx0 : (cx > cx1) ? cx1 : cx;
+  cy = (cy < cy0) ? cy0 : (cy > cy1) ? cy1 : cy;
+  for (int32_t r = 0; r < (1 << TILE_SHIFT); r++) {
+    for (int32_t j = cy - r; j <= cy + r; j++) {
+      if ((j < cy0) || (j > cy1))
+        continue;
+      // Whole row of the ring at top & bottom, else just the two ends
+      int32_t step = ((j == cy - r) || (j == cy + r)) ? 1 : 2 * r;
+      for (int32_t i = cx - r; i <= cx + r; i += step) {
+        if ((i >= cx0) && (i <= cx1))
+          findIn(level - 1, i, j, x, y, best, fx, fy);
+      }
+    }
+  }
 }
-static int compare3(const void *a, const void *b) {
-  return ((Grain *)a)->x - ((Grain *)a)->y - ((Grain *)b)->x + ((Grain *)b)->y;
+
+// Pick a free pixel at random, all equally likely, using the summary.
+// Returns false if there are none.
+bool Adafruit_PixelDust::randomFree(dimension_t *x, dimension_t *y) {
+  Adafruit_PixelDust_Tiles *t = tiles;
+  uint8_t level = t->levels;
+  uint32_t nx = 0, ny = 0, cx = 0, cy = 0,
+           k = (uint32_t)width * height - nodeCount(t, level, 0, 0);
+  if (!k)
+    return false;
+  k = ((uint64_t)rng.next() * k) >> 32; // Pick the k'th free pixel...
+  for (; level > 1; level--) {          // ...find the child holding it...
+    uint8_t s = (level - 1) * TILE_SHIFT;
+    uint32_t cx0 = nx << TILE_SHIFT, cy0 = ny << TILE_SHIFT,
+             cx1 = cx0 + (1 << TILE_SHIFT), cy1 = cy0 + (1 << TILE_SHIFT);
+    if (cx1 > t->cols[level - 1])
+      cx1 = t->cols[level - 1];
+    if (cy1 > t->rows[level - 1])
+      cy1 = t->rows[level - 1];
+    for (cy = cy0; cy < cy1; cy++) {
+      for (cx = cx0; cx < cx1; cx++) {
+        uint32_t w = ((cx + 1) << s > width) ? width - (cx << s) : 1UL << s,
+                 h = ((cy + 1) << s > height) ? height - (cy << s) : 1UL << s,
+                 f = w * h - nodeCount(t, level - 1, cx, cy);
+        if (k < f)
+          break;
+        k -= f;
+      }
+      if (cx < cx1)
+        break;
+    }
+    nx = cx;
+    ny = cy;
+  }
+  uint32_t px0 = nx << TILE_SHIFT, py0 = ny << TILE_SHIFT,
+           px1 = (px0 + 8 > width) ? width : px0 + 8;
+  for (uint32_t py = py0; py < height; py++) { // ...and the pixel in it
+    uint8_t free = ~tileBits(px0, py) & (0xFF << (px0 + 8 - px1));
+    for (; free; k--) {
+      uint8_t b = __builtin_clz(free) - 24; // Leftmost free pixel
+      if (!k) {
+        *x = px0 + b;
+        *y = py;
+        return true;
+      }
+      free &= ~(0x80 >> b);
+    }
+  }
+  return false; // Not reached unless summary is wrong
 }
-static int compare4(const void *a, const void *b) {
-  return ((Grain *)a)->x - ((Grain *)b)->x;
+
+#endif // !__AVR__
+
+#ifdef PIXELDUST_SPARSE
+
+// Give a block (currently w, one of the shared ones) its own copy to
+// write to.  Worker threads may do this for different rows of the same
+// block at once: the first copy to be stored wins, and the others are
+// freed in favor of it.  Returns NULL if out of memory.
+bitmap_word_t *Adafruit_PixelDust::unshareBlock(bitmap_word_t **b,
+                                                bitmap_word_t *w) {
+  bitmap_word_t *copy = (bitmap_word_t *)malloc(BLOCK_BYTES);
+  if (!copy)
+    return NULL;
+  memcpy(copy, w, BLOCK_BYTES);
+#ifdef PIXELDUST_THREADS
+  if (!__atomic_compare_exchange_n(b, &w, copy, false, __ATOMIC_RELEASE,
+                                   __ATOMIC_CONSUME)) {
+    free(copy);
+    return w; // Another thread's copy
+  }
+#else
+  *b = copy;
+#endif
+  return copy;
 }
-static int compare5(const void *a, const void *b) {
-  return ((Grain *)a)->x + ((Grain *)a)->y - ((Grain *)b)->x - ((Grain *)b)->y;
+
+// Return blocks overlapping pixels x0 to x1-1, y0 to y1-1 that are all
+// empty, or all set, to the shared copies.  Blocks reaching past the edge
+// of the grid are never all set, as bits beyond it are always 0.
+void Adafruit_PixelDust::shareBlocks(dimension_t x0, dimension_t y0,
+                                     dimension_t x1, dimension_t y1) {
+  const bitmap_word_t all = ~(bitmap_word_t)0;
+  for (uint32_t by = y0 >> PIXELDUST_BLOCK_SHIFT;
+       by <= (y1 - 1U) >> PIXELDUST_BLOCK_SHIFT; by++) {
+    for (uint32_t bx = x0 >> PIXELDUST_BLOCK_SHIFT;
+         bx <= (x1 - 1U) >> PIXELDUST_BLOCK_SHIFT; bx++) {
+      bitmap_word_t **b = &block[by * blockCols + bx], *w = *b;
+      bitmap_word_t any = 0, every = all;
+      if (sharedBlock(w))
+        continue;
+      for (uint16_t i = 0; i < PIXELDUST_BLOCK_WORDS; i++) {
+        any |= w[i];
+        every &= w[i];
+      }
+      if (!any) {
+        *b = bitmap;
+      } else if (every == all) {
+        *b = &bitmap[PIXELDUST_BLOCK_WORDS];
+      } else {
+        continue;
+      }
+      free(w);
+    }
+  }
 }
-static int compare6(const void *a, const void *b) {
-  return ((Grain *)a)->y - ((Grain *)b)->y;
+
+// Free all blocks, leaving the grid empty
+void Adafruit_PixelDust::freeBlocks(void) {
+  size_t blocks =
+      (size_t)blockCols * ((height + BLOCK_MASK) >> PIXELDUST_BLOCK_SHIFT);
+  for (size_t i = 0; i < blocks; i++) {
+    if (!sharedBlock(block[i]))
+      free(block[i]);
+    block[i] = bitmap;
+  }
 }
-static int compare7(const void *a, const void *b) {
-  return ((Grain *)b)->x - ((Grain *)b)->y - ((Grain *)a)->x + ((Grain *)a)->y;
+
+size_t Adafruit_PixelDust::compactBitmap(void) {
+  if (!bitmap)
+    return 0;
+  size_t blocks =
+      (size_t)blockCols * ((height + BLOCK_MASK) >> PIXELDUST_BLOCK_SHIFT);
+  size_t bytes = 2 * BLOCK_BYTES + blocks * sizeof(bitmap_word_t *);
+  shareBlocks(0, 0, width, height);
+  for (size_t i = 0; i < blocks; i++) {
+    if (!sharedBlock(block[i]))
+      bytes += BLOCK_BYTES;
+  }
+  return bytes;
 }
-static int (*compare[8])(const void *a, const void *b) = {
-    compare0, compare1, compare2, compare3,
-    compare4, compare5, compare6, compare7};
 
-// Calculate one frame of particle interactions
-void Adafruit_PixelDust::iterate(int16_t ax, int16_t ay, int16_t az) {
+#endif // PIXELDUST_SPARSE
 
-  ax = (int32_t)ax * scale / 256;       // Scale down raw accelerometer
-  ay = (int32_t)ay * scale / 256;       // inputs to manageable range.
-  az = abs((int32_t)az * scale / 2048); // Z is further scaled down 1:8
-  // A tiny bit of random motion is applied to each grain, so that tall
-  // stacks of pixels tend to topple (else the whole stack slides across
-  // the display).  This is a function of the Z axis input, so it's more
-  // pronounced the more the display is tilted (else the grains shift
-  // around too much when the display is held level).
-  az = (az >= 4) ? 1 : 5 - az; // Clip & invert
-  ax -= az;                    // Subtract Z motion factor from X, Y,
-  ay -= az;                    // then...
-  int16_t az2 = az * 2 + 1;    // max random motion to add back in
+// Snapshot format, see saveSnapshot().  This header is followed by the
+// bitmap, then grain data in the layout in use (Grain structs, or the four
+// PIXELDUST_SOA arrays), each padded to a multiple of 8 bytes so the data
+// is aligned in place for attachSnapshot().  If sleep is enabled, there's
+// then the gravity grains last all woke for, each grain's rest count and
+// the active list (see enableSleep()); if grains have materials, a count
+// and table of materials and a material number for each grain (see
+// setMaterials()); and if sorting, the grain order list (as 32-bit
+// values, whatever grain_count_t is), each also padded.
 
-  grain_count_t i;
+#define SNAPSHOT_VERSION 1       ///< Increment on any format change
+#define SNAPSHOT_SOA 0x01        ///< Layout flag: PIXELDUST_SOA
+#define SNAPSHOT_BIG_ENDIAN 0x02 ///< Layout flag: big-endian words
+#define SNAPSHOT_REST 0x04       ///< Flag: sleep state follows grains
+#define SNAPSHOT_MATERIALS 0x08  ///< Flag: material data follows that
+#define SNAPSHOT_ORDER 0x10      ///< Flag: sorted order follows that
+#define SNAPSHOT_SECTIONS                                                      \
+  (SNAPSHOT_REST | SNAPSHOT_MATERIALS | SNAPSHOT_ORDER) ///< Optional
 
-  if (sort) {
-    int8_t q;
-    q = (int)(atan2(ay, ax) * 8.0 / M_PI); // -8 to +8
-    if (q >= 0)
-      q = (q + 1) / 2;
-    else
-      q = (q + 16) / 2;
-    if (q > 7)
-      q = 7;
-    // Sort grains by position, bottom-to-top
-    qsort(grain, n_grains, sizeof(Grain), compare[q]);
-  }
+/*! Snapshot header, 32 bytes */
+typedef struct {
+  char magic[4];       ///< "PXDS"
+  uint8_t version;     ///< SNAPSHOT_VERSION
+  uint8_t layout;      ///< SNAPSHOT_* layout flags
+  uint8_t wordBytes;   ///< sizeof(bitmap_word_t)
+  uint8_t posBytes;    ///< sizeof(position_t)
+  uint16_t width;      ///< Width in pixels
+  uint16_t height;     ///< Height in pixels
+  uint32_t grains;     ///< Number of grains
+  uint32_t rngState;   ///< Random number generator state
+  uint32_t stepPeriod; ///< advance() microseconds per step
+  uint32_t stepTime;   ///< advance() time not yet simulated
+  uint8_t scale;       ///< Accelerometer scaling
+  uint8_t elasticity;  ///< Grain elasticity
+  uint8_t sortOctant;  ///< Direction of last sort
+  uint8_t maxSteps;    ///< advance() max steps per call
+} SnapshotHeader;
 
-  // Apply 2D accel vector to grain velocities...
-  int32_t v2; // Velocity squared
-  float v;    // Absolute velocity
-  for (i = 0; i < n_grains; i++) {
-    grain[i].vx += ax + random(az2);
-    grain[i].vy += ay + random(az2);
-    // Terminal velocity (in any direction) is 256 units -- equal to
-    // 1 pixel -- which keeps moving grains from passing through each other
-    // and other such mayhem.  Though it takes some extra math, velocity is
-    // clipped as a 2D vector (not separately-limited X & Y) so that
-    // diagonal movement isn't faster than horizontal/vertical.
-    v2 =
-        (int32_t)grain[i].vx * grain[i].vx + (int32_t)grain[i].vy * grain[i].vy;
-    if (v2 > 65536) {      // If v^2 > 65536, then v > 256
-      v = sqrt((float)v2); // Velocity vector magnitude
-      grain[i].vx = (int)(256.0 * (float)grain[i].vx / v); // Maintain heading &
-      grain[i].vy = (int)(256.0 * (float)grain[i].vy / v); // limit magnitude
+// Round up to multiple of 8 bytes
+static inline size_t pad8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+// Size of snapshot sleep data for n grains: nActive, sleepAx, sleepAy,
+// sleepDir and padding, rest counts, then active list (32-bit values)
+static inline size_t restBytes(size_t n) {
+  return pad8(12 + n) + pad8(n * 4);
+}
+
+// Size of snapshot material data for n grains
+static inline size_t materialBytes(size_t n) {
+  return pad8(1 + PIXELDUST_MAX_MATERIALS * sizeof(GrainMaterial) + n);
+}
+
+// Size of snapshot with given optional sections (SNAPSHOT_SECTIONS flags)
+size_t Adafruit_PixelDust::snapshotBytes(uint8_t sections) const {
+  return sizeof(SnapshotHeader) +
+         pad8((size_t)stride * height * sizeof(bitmap_word_t)) +
+         pad8((size_t)n_grains * GRAIN_BYTES) +
+         ((sections & SNAPSHOT_REST) ? restBytes(n_grains) : 0) +
+         ((sections & SNAPSHOT_MATERIALS) ? materialBytes(n_grains) : 0) +
+         ((sections & SNAPSHOT_ORDER) ? pad8((size_t)n_grains * 4) : 0);
+}
+
+// Layout flags for this build
+static uint8_t snapshotLayout(void) {
+  uint16_t one = 1;
+  uint8_t layout = *(uint8_t *)&one ? 0 : SNAPSHOT_BIG_ENDIAN;
+#ifdef PIXELDUST_SOA
+  layout |= SNAPSHOT_SOA;
+#endif
+  return layout;
+}
+
+size_t Adafruit_PixelDust::getSnapshotSize(void) const {
+  return snapshotBytes((rest ? SNAPSHOT_REST : 0) |
+                       (material ? SNAPSHOT_MATERIALS : 0) |
+                       (order ? SNAPSHOT_ORDER : 0));
+}
+
+size_t Adafruit_PixelDust::saveSnapshot(void *buf, size_t size) const {
+  size_t total = getSnapshotSize(),
+         bytes = (size_t)stride * height * sizeof(bitmap_word_t);
+  if (!bitmap || (size < total))
+    return 0;
+  SnapshotHeader h;
+  memcpy(h.magic, "PXDS", 4);
+  h.version = SNAPSHOT_VERSION;
+  h.layout = snapshotLayout() | (rest ? SNAPSHOT_REST : 0) |
+             (material ? SNAPSHOT_MATERIALS : 0) | (order ? SNAPSHOT_ORDER : 0);
+  h.wordBytes = sizeof(bitmap_word_t);
+  h.posBytes = sizeof(position_t);
+  h.width = width;
+  h.height = height;
+  h.grains = n_grains;
+  h.rngState = rng.getState();
+  h.stepPeriod = stepPeriod;
+  h.stepTime = stepTime;
+  h.scale = scale;
+  h.elasticity = elasticity;
+  h.sortOctant = sortOctant;
+  h.maxSteps = maxSteps;
+  uint8_t *p = (uint8_t *)buf;
+  memset(p, 0, total); // Padding is zeroed so snapshots compare equal
+  memcpy(p, &h, sizeof h);
+  p += sizeof h;
+#ifdef PIXELDUST_SPARSE
+  // Snapshot bitmap is contiguous rows, as without PIXELDUST_SPARSE
+  for (dimension_t y = 0; y < height; y++) {
+    for (dimension_t k = 0; k < stride; k++, p += sizeof(bitmap_word_t))
+      memcpy(p, readWord(k * PIXELDUST_WORD_BITS, y), sizeof(bitmap_word_t));
+  }
+  p += pad8(bytes) - bytes;
+#else
+  memcpy(p, bitmap, bytes);
+  p += pad8(bytes);
+#endif
+  if (n_grains) {
+#ifdef PIXELDUST_SOA
+    memcpy(p, gx, (size_t)n_grains * GRAIN_BYTES);
+#else
+    memcpy(p, grain, (size_t)n_grains * sizeof(Grain));
+#endif
+    p += pad8((size_t)n_grains * GRAIN_BYTES);
+    if (rest) {
+      uint32_t g = nActive;
+      memcpy(p, &g, 4);
+      memcpy(&p[4], &sleepAx, 2);
+      memcpy(&p[6], &sleepAy, 2);
+      p[8] = sleepDir;
+      memcpy(&p[12], rest, n_grains);
+      for (grain_count_t i = 0; i < nActive; i++) {
+        g = active[i];
+        memcpy(&p[pad8(12 + (size_t)n_grains) + i * 4], &g, 4);
+      }
+      p += restBytes(n_grains);
+    }
+    if (material) {
+      p[0] = nMaterials;
+      memcpy(&p[1], materials, nMaterials * sizeof(GrainMaterial));
+      memcpy(&p[1 + PIXELDUST_MAX_MATERIALS * sizeof(GrainMaterial)],
+             material, n_grains);
+      p += materialBytes(n_grains);
+    }
+    if (order) {
+      for (grain_count_t i = 0; i < n_grains; i++) {
+        uint32_t g = order[i];
+        memcpy(&p[i * 4], &g, 4);
+      }
     }
   }
+  return total;
+}
 
-  // ...then update position of each grain, one at a time, checking for
-  // collisions and having them react.  This really seems like it shouldn't
-  // work, as only one grain is considered at a time while the rest are
-  // regarded as stationary.  Yet this naive algorithm, taking many not-
-  // technically-quite-correct steps, and repeated quickly enough,
-  // visually integrates into something that somewhat resembles physics.
-  // (I'd initially tried implementing this as a bunch of concurrent and
-  // "realistic" elastic collisions among circular grains, but the
-  // calculations and volume of code quickly got out of hand for both
-  // the tiny 8-bit AVR microcontroller and my tiny dinosaur brain.)
-
-  position_t newx, newy;
-#ifdef __AVR__
-  int16_t oldidx, newidx, delta;
+// Check snapshot header against this build and simulation, then that
+// every grain is on the playfield, on a pixel that's set, and no faster
+// than terminal velocity, so corrupt or mismatched data can't lead
+// iterate() to index outside the bitmap
+bool Adafruit_PixelDust::checkSnapshot(const void *buf, size_t size) const {
+  SnapshotHeader h;
+  if (size < sizeof h)
+    return false;
+  memcpy(&h, buf, sizeof h); // buf might not be aligned
+  if (memcmp(h.magic, "PXDS", 4) || (h.version != SNAPSHOT_VERSION) ||
+      ((h.layout & ~SNAPSHOT_SECTIONS) != snapshotLayout()) ||
+      (h.wordBytes != sizeof(bitmap_word_t)) ||
+      (h.posBytes != sizeof(position_t)) || (h.width != width) ||
+      (h.height != height) || (h.grains != n_grains) ||
+      (size < snapshotBytes(h.layout)))
+    return false;
+  size_t bytes = (size_t)stride * height * sizeof(bitmap_word_t);
+  const uint8_t *bits = (const uint8_t *)buf + sizeof h,
+                *g = bits + pad8(bytes);
+  for (grain_count_t i = 0; i < n_grains; i++) {
+    position_t x, y;
+    velocity_t vx, vy;
+#ifdef PIXELDUST_SOA
+    const uint8_t *v = &g[(size_t)n_grains * 2 * sizeof(position_t)];
+    memcpy(&x, &g[(size_t)i * sizeof x], sizeof x);
+    memcpy(&y, &g[((size_t)n_grains + i) * sizeof y], sizeof y);
+    memcpy(&vx, &v[(size_t)i * sizeof vx], sizeof vx);
+    memcpy(&vy, &v[((size_t)n_grains + i) * sizeof vy], sizeof vy);
 #else
-  int32_t oldidx, newidx, delta;
+    Grain s;
+    memcpy(&s, &g[(size_t)i * sizeof s], sizeof s);
+    x = s.x;
+    y = s.y;
+    vx = s.vx;
+    vy = s.vy;
 #endif
+    if ((vx < -256) || (vx > 256) || (vy < -256) || (vy > 256) ||
+        (x < -1) || (x > xMax) || (y < 0) || (y > yMax))
+      return false;
+    if (x < 0)
+      continue; // Grain not placed yet (see allocGrains())
+    dimension_t px = x / 256, py = y / 256;
+    size_t k = (size_t)py * stride + px / PIXELDUST_WORD_BITS;
+    uint8_t bit = PIXELDUST_WORD_BITS - 1 - px % PIXELDUST_WORD_BITS;
+    bitmap_word_t w;
+    memcpy(&w, &bits[k * sizeof w], sizeof w);
+    if (!((w >> bit) & 1))
+      return false; // Grain's pixel is clear
+  }
+  return true;
+}
 
-  for (i = 0; i < n_grains; i++) {
-    newx = grain[i].x + grain[i].vx; // New position in grain space
-    newy = grain[i].y + grain[i].vy;
-    if (newx < 0) {        // If grain would go out of bounds
-      newx = 0;            // keep it inside,
-      BOUNCE(grain[i].vx); // and bounce off wall
-    } else if (newx > xMax) {
-      newx = xMax;
-      BOUNCE(grain[i].vx);
-    }
-    if (newy < 0) {
-      newy = 0;
-      BOUNCE(grain[i].vy);
-    } else if (newy > yMax) {
-      newy = yMax;
-      BOUNCE(grain[i].vy);
-    }
-
-    // oldidx/newidx are the prior and new pixel index for this grain.
-    // It's a little easier to check motion vs handling X & Y separately.
-    oldidx = (grain[i].y / 256) * width + (grain[i].x / 256);
-    newidx = (newy / 256) * width + (newx / 256);
-
-    if ((oldidx != newidx) && // If grain is moving to a new pixel...
-        getPixel(newx / 256, newy / 256)) { // but if pixel already occupied...
-      delta = abs(newidx - oldidx);         // What direction when blocked?
-      if (delta == 1) {                     // 1 pixel left or right)
-        newx = grain[i].x;                  // Cancel X motion
-        BOUNCE(grain[i].vx);                // and bounce X velocity (Y is OK)
-      } else if (delta == width) {          // 1 pixel up or down
-        newy = grain[i].y;                  // Cancel Y motion
-        BOUNCE(grain[i].vy);                // and bounce Y velocity (X is OK)
-      } else { // Diagonal intersection is more tricky...
-        // Try skidding along just one axis of motion if possible
-        // (start w/faster axis).
-        if (abs(grain[i].vx) >= abs(grain[i].vy)) {      // X axis is faster
-          if (!getPixel(newx / 256, grain[i].y / 256)) { // newx, oldy
-            // That pixel's free!  Take it!  But...
-            newy = grain[i].y;   // Cancel Y motion
-            BOUNCE(grain[i].vy); // and bounce Y velocity
-          } else {               // X pixel is taken, so try Y...
-            if (!getPixel(grain[i].x / 256, newy / 256)) { // oldx, newy
-              // Pixel is free, take it, but first...
-              newx = grain[i].x;   // Cancel X motion
-              BOUNCE(grain[i].vx); // and bounce X velocity
-            } else {               // Both spots are occupied
-              newx = grain[i].x;   // Cancel X & Y motion
-              newy = grain[i].y;
-              BOUNCE(grain[i].vx); // Bounce X & Y velocity
-              BOUNCE(grain[i].vy);
-            }
-          }
-        } else { // Y axis is faster, start there
-          if (!getPixel(grain[i].x / 256, newy / 256)) { // oldx, newy
-            // Pixel's free!  Take it!  But...
-            newx = grain[i].x;   // Cancel X motion
-            BOUNCE(grain[i].vx); // and bounce X velocity
-          } else {               // Y pixel is taken, so try X...
-            if (!getPixel(newx / 256, grain[i].y / 256)) { // newx, oldy
-              // Pixel is free, take it, but first...
-              newy = grain[i].y;   // Cancel Y motion
-              BOUNCE(grain[i].vy); // and bounce Y velocity
-            } else {               // Both spots are occupied
-              newx = grain[i].x;   // Cancel X & Y motion
-              newy = grain[i].y;
-              BOUNCE(grain[i].vx); // Bounce X & Y velocity
-              BOUNCE(grain[i].vy);
-            }
-          }
+// Set up grain materials from a snapshot, or reset to material 0 if it
+// has none.  Called before loading other data, as this may fail.
+bool Adafruit_PixelDust::loadMaterials(const void *buf) {
+  SnapshotHeader h;
+  memcpy(&h, buf, sizeof h);
+  if (!(h.layout & SNAPSHOT_MATERIALS)) {
+    if (material)
+      memset(material, 0, n_grains);
+    return true;
+  }
+  const uint8_t *p =
+      (const uint8_t *)buf + snapshotBytes(h.layout & SNAPSHOT_REST);
+  GrainMaterial table[PIXELDUST_MAX_MATERIALS];
+  memcpy(table, &p[1], sizeof table);
+  if (!setMaterials(table, p[0]))
+    return false;
+  if (material) {
+    memcpy(material, &p[1 + sizeof table], n_grains);
+    for (grain_count_t i = 0; i < n_grains; i++) {
+      if (material[i] >= nMaterials) // Corrupt? Don't index past table
+        material[i] = 0;
+    }
+  }
+  return true;
+}
+
+// Load snapshot parameters (bitmap & grains are handled by caller) and
+// reset anything derived from the previous state
+void Adafruit_PixelDust::loadSnapshot(const void *buf) {
+  SnapshotHeader h;
+  memcpy(&h, buf, sizeof h);
+  rng.seed(h.rngState);
+  setStep(h.stepPeriod, h.maxSteps);
+  stepTime = h.stepTime;
+  scale = h.scale;
+  elasticity = h.elasticity;
+  if (order) {
+    // Use snapshot's sorted order if it has one and it's a permutation
+    // (each grain exactly once), else start over in index order
+    grain_count_t i;
+    bool valid = false;
+    sortOctant = 0xFF;
+    if (h.layout & SNAPSHOT_ORDER) {
+      const uint8_t *p =
+          (const uint8_t *)buf +
+          snapshotBytes(h.layout & (SNAPSHOT_REST | SNAPSHOT_MATERIALS));
+      uint32_t g;
+      // order[] marks grains seen so far, no scratch space needed
+      for (i = 0; i < n_grains; i++)
+        order[i] = PIXELDUST_EMPTY;
+      for (i = 0; i < n_grains; i++) {
+        memcpy(&g, &p[i * 4], 4);
+        if ((g >= n_grains) || (order[g] != PIXELDUST_EMPTY))
+          break; // Corrupt, out of range or repeated
+        order[g] = i;
+      }
+      if (i == n_grains) {
+        for (i = 0; i < n_grains; i++) {
+          memcpy(&g, &p[i * 4], 4);
+          order[i] = g;
         }
+        sortOctant = h.sortOctant;
+        valid = true;
       }
     }
-    clearPixel(grain[i].x / 256, grain[i].y / 256); // Clear old spot
-    grain[i].x = newx;                              // Update grain position
-    grain[i].y = newy;
-    setPixel(newx / 256, newy / 256); // Set new spot
+    if (!valid) {
+      for (i = 0; i < n_grains; i++)
+        order[i] = i;
+    }
+  }
+  nChanges = 0;
+  if (grainMap)
+    enableGrainMap(); // Refill
+#ifndef __AVR__
+  if (tiles)
+    countTiles(0, 0, width, height);
+#endif
+  if (rest && !((h.layout & SNAPSHOT_REST) && loadRest(buf)))
+    wakeAll(); // No sleep state, or it's corrupt
+}
+
+// Load sleep state from a snapshot, for loadSnapshot().  The active list
+// must hold exactly the grains not asleep, each once, else returns false
+// (rest[] and active[] are then left for wakeAll() to reset).
+bool Adafruit_PixelDust::loadRest(const void *buf) {
+  const uint8_t *p = (const uint8_t *)buf + snapshotBytes(0),
+                *a = &p[pad8(12 + (size_t)n_grains)];
+  uint32_t count, g;
+  grain_count_t i, awake = 0;
+  memcpy(&count, p, 4);
+  memcpy(rest, &p[12], n_grains);
+  for (i = 0; i < n_grains; i++)
+    awake += (rest[i] != GRAIN_ASLEEP);
+  if (count != awake)
+    return false;
+  for (i = 0; i < awake; i++) {
+    memcpy(&g, &a[i * 4], 4);
+    if ((g >= n_grains) || (rest[g] == GRAIN_ASLEEP))
+      return false; // Out of range, asleep or repeated
+    rest[g] = GRAIN_ASLEEP; // Mark seen, restored below
+    active[i] = g;
   }
+  memcpy(rest, &p[12], n_grains);
+  nActive = awake;
+  memcpy(&sleepAx, &p[4], 2);
+  memcpy(&sleepAy, &p[6], 2);
+  sleepDir = p[8];
+  return true;
 }
+
+bool Adafruit_PixelDust::restoreSnapshot(const void *buf, size_t size) {
+  if (!checkSnapshot(buf, size) || !begin() || !loadMaterials(buf))
+    return false;
+  const uint8_t *p = (const uint8_t *)buf + sizeof(SnapshotHeader);
+  size_t bytes = (size_t)stride * height * sizeof(bitmap_word_t);
+#ifdef PIXELDUST_SPARSE
+  freeBlocks();
+  for (dimension_t y = 0; y < height; y++) {
+    for (dimension_t k = 0; k < stride; k++) {
+      bitmap_word_t v, *w;
+      memcpy(&v, &p[((size_t)y * stride + k) * sizeof v], sizeof v);
+      if (v) { // Empty words are already so, no need to allocate
+        if (!(w = writeWord(k * PIXELDUST_WORD_BITS, y)))
+          return false;
+        *w = v;
+      }
+    }
+  }
+  shareBlocks(0, 0, width, height); // Any entirely obstacle
+#else
+  memcpy(bitmap, p, bytes);
+#endif
+  p += pad8(bytes);
+  if (n_grains) {
+#ifdef PIXELDUST_SOA
+    memcpy(gx, p, (size_t)n_grains * GRAIN_BYTES);
+#else
+    memcpy(grain, p, (size_t)n_grains * sizeof(Grain));
+#endif
+  }
+  loadSnapshot(buf);
+  return true;
+}
+
+bool Adafruit_PixelDust::attachSnapshot(void *buf, size_t size) {
+#ifdef PIXELDUST_SPARSE
+  (void)buf;
+  (void)size;
+  return false; // Snapshot's contiguous bitmap can't be used as blocks
+#else
+#ifdef PIXELDUST_COMPACT
+  if (!COMPACT_FITS)
+    return false; // As in begin()
+#endif
+  if (!checkSnapshot(buf, size) || !loadMaterials(buf))
+    return false;
+  if (!allocSort()) // If begin() didn't already
+    return false;
+#ifndef __AVR__
+  // Row pointers can't follow the bitmap as in begin(), so alloc separately
+  bitmap_word_t **r =
+      attached ? row
+               : (bitmap_word_t **)malloc(height * sizeof(bitmap_word_t *));
+  if (!r)
+    return false;
+#endif
+  // Replace anything begin() allocated with the snapshot's data
+  if (bitmap && !attached)
+    free(bitmap);
+  freeGrains();
+  attached = true;
+  uint8_t *p = (uint8_t *)buf + sizeof(SnapshotHeader);
+  bitmap = (bitmap_word_t *)p;
+#ifndef __AVR__
+  row = r;
+  for (dimension_t y = 0; y < height; y++)
+    row[y] = &bitmap[(size_t)y * stride];
+#endif
+  p += pad8((size_t)stride * height * sizeof(bitmap_word_t));
+#ifdef PIXELDUST_SOA
+  gx = (position_t *)p;
+  gy = &gx[n_grains];
+  gvx = (velocity_t *)&gy[n_grains];
+  gvy = &gvx[n_grains];
+#else
+  grain = (Grain *)p;
+#endif
+  loadSnapshot(buf);
+  return true;
+#endif // !PIXELDUST_SPARSE
+}
+
+// Add a 32-bit value to an FNV-1a hash, a byte at a time (least
+// significant first, whatever the host byte order)
+static uint32_t hashValue(uint32_t h, uint32_t v) {
+  for (uint8_t i = 0; i < 4; i++, v >>= 8)
+    h = (h ^ (v & 0xFF)) * 16777619UL;
+  return h;
+}
+
+uint32_t Adafruit_PixelDust::getHash(void) const {
+  uint32_t h = 2166136261UL; // FNV-1a offset basis
+  if (!bitmap)
+    return h;
+  // Values, not memory, are hashed, so the result doesn't depend on grain
+  // layout, type sizes or structure padding...
+  for (grain_count_t i = 0; i < n_grains; i++) {
+    h = hashValue(h, (int32_t)GX(i));
+    h = hashValue(h, (int32_t)GY(i));
+    h = hashValue(h, (int32_t)GVX(i));
+    h = hashValue(h, (int32_t)GVY(i));
+  }
+  // ...and the bitmap a byte (8 pixels) at a time, whatever the word size
+  for (dimension_t y = 0; y < height; y++) {
+#ifdef PIXELDUST_SPARSE
+    for (dimension_t x = 0; x < width; x += 8)
+      h = (h ^ tileBits(x, y)) * 16777619UL;
+#else
+    const bitmap_word_t *r = &bitmap[(size_t)y * stride];
+    for (dimension_t x = 0; x < width; x += 8) {
+      uint8_t b = r[x / PIXELDUST_WORD_BITS] >>
+                  (PIXELDUST_WORD_BITS - 8 - x % PIXELDUST_WORD_BITS);
+      h = (h ^ b) * 16777619UL;
+    }
+#endif
+  }
+  return hashValue(h, rng.getState());
+}
+
+// Fill grain structures with random positions, making sure no two are
+// in the same location.
+void Adafruit_PixelDust::randomize(void) {
+  for (grain_count_t i = 0; i < n_grains; i++) {
+#ifndef __AVR__
+    if (tiles) {
+      // One random try, else pick from the free pixels (quicker than
+      // more tries once the grid is mostly full)
+      dimension_t x = rng.bounded(width), y = rng.bounded(height);
+      if ((getPixel(x, y) && !randomFree(&x, &y)) || !setPosition(i, x, y))
+        return; // Grid is full, or (PIXELDUST_SPARSE) out of memory
+      continue;
+    }
+#endif
+    while (!setPosition(i, rng.bounded(width), rng.bounded(height)))
+      ;
+  }
+}
+
+// Pixel set/read functions for the bitmap buffer.  Shift-by-N operations
+// are costly on AVR, so table lookups are used.  Other architectures use
+// shifts, and the lowest-level functions are inline in the header.
+
+#ifdef __AVR__
+
+static const uint8_t PROGMEM clr[] = {~0x80, ~0x40, ~0x20, ~0x10,
+                                      ~0x08, ~0x04, ~0x02, ~0x01},
+                             set[] = {0x80, 0x40, 0x20, 0x10,
+                                      0x08, 0x04, 0x02, 0x01};
+
+void Adafruit_PixelDust::setBit(dimension_t x, dimension_t y) {
+  bitmap[y * stride + x / 8] |= pgm_read_byte(&set[x & 7]);
+}
+
+void Adafruit_PixelDust::clearBit(dimension_t x, dimension_t y) {
+  bitmap[y * stride + x / 8] &= pgm_read_byte(&clr[x & 7]);
+}
+
+bool Adafruit_PixelDust::getPixel(dimension_t x, dimension_t y) const {
+  return bitmap[y * stride + x / 8] & pgm_read_byte(&set[x & 7]);
+}
+
+#endif // __AVR__
+
+void Adafruit_PixelDust::setPixel(dimension_t x, dimension_t y) {
+#ifndef __AVR__
+  if (tiles && !getPixel(x, y))
+    addTiles(x, y, 1);
+#endif
+  setBit(x, y);
+  if (grainMap)
+    grainMap[y * width + x] = PIXELDUST_OBSTACLE;
+}
+
+void Adafruit_PixelDust::clearPixel(dimension_t x, dimension_t y) {
+#ifndef __AVR__
+  if (tiles && getPixel(x, y))
+    addTiles(x, y, -1);
+#endif
+  clearBit(x, y);
+  if (grainMap)
+    grainMap[y * width + x] = PIXELDUST_EMPTY;
+  if (rest)
+    wakeAround(x, y);
+}
+
+// Clears bitmap buffer.  Grain positions are unchanged,
+// probably want to follow up with some place() calls.
+void Adafruit_PixelDust::clear(void) {
+#ifdef PIXELDUST_SPARSE
+  if (bitmap)
+    freeBlocks();
+#else
+  if (bitmap)
+    memset(bitmap, 0, (size_t)stride * height * sizeof(bitmap_word_t));
+#endif
+#ifndef __AVR__
+  if (tiles)
+    countTiles(0, 0, width, height);
+#endif
+  if (grainMap) // All pixels PIXELDUST_EMPTY
+    memset(grainMap, 0xFF, (size_t)width * height * sizeof(grain_count_t));
+}
+
+// Count of leading (leftmost pixel) zero bits in a nonzero bitmap word
+static inline uint8_t leadingZeros(bitmap_word_t w) {
+  if (sizeof(bitmap_word_t) > sizeof(unsigned int))
+    return __builtin_clzll(w);
+  return __builtin_clz((unsigned int)w) -
+         (sizeof(unsigned int) - sizeof(bitmap_word_t)) * 8;
+}
+
+// Get one bitmap word's worth of bits from a 1-bit-per-pixel mask row,
+// starting at bit s (MSB of first byte is bit 0).  s may be negative, and
+// bytes outside the first n are read as 0, so the row is never overrun.
+static bitmap_word_t maskBits(const uint8_t *src, int32_t s, uint16_t n) {
+  bitmap_word_t w = 0;
+  int32_t b = (s < 0) ? -((7 - s) / 8) : s / 8; // Byte holding bit s
+  uint8_t shift = s - b * 8, c;
+  for (uint8_t i = 0; i < sizeof(bitmap_word_t); i++, b++)
+    w = (w << 8) | (((b >= 0) && (b < n)) ? src[b] : 0);
+  if (shift) {
+    c = ((b >= 0) && (b < n)) ? src[b] : 0;
+    w = (w << shift) | (c >> (8 - shift));
+  }
+  return w;
+}
+
+// Apply op to pixels x to x+w-1 (already clipped) of bitmap row y, from
+// mask bits sx onward of src, or from all 1s if src is NULL.
+void Adafruit_PixelDust::rowOp(dimension_t y, dimension_t x, dimension_t w,
+                               const uint8_t *src, dimension_t sx,
+                               pixeldust_op_t op) {
+#ifndef PIXELDUST_SPARSE
+  bitmap_word_t *r = &bitmap[(size_t)y * stride];
+#endif
+  bitmap_word_t all = ~(bitmap_word_t)0;
+  dimension_t k = x / PIXELDUST_WORD_BITS,
+              kEnd = (x + w - 1) / PIXELDUST_WORD_BITS;
+  uint16_t n = (sx + w + 7) / 8;                     // Mask bytes used
+  int32_t s = (int32_t)sx - x % PIXELDUST_WORD_BITS; // Mask bit at word start
+  for (; k <= kEnd; k++, s += PIXELDUST_WORD_BITS) {
+    // Bits of this word within the span
+    bitmap_word_t m = all;
+    if (k == x / PIXELDUST_WORD_BITS)
+      m >>= x % PIXELDUST_WORD_BITS;
+    if (k == kEnd)
+      m &= all << (PIXELDUST_WORD_BITS - 1 - (x + w - 1) % PIXELDUST_WORD_BITS);
+#ifdef PIXELDUST_SPARSE
+    bitmap_word_t old = *readWord(k * PIXELDUST_WORD_BITS, y), v, *dst;
+#else
+    bitmap_word_t old = r[k], v;
+#endif
+    bitmap_word_t bits = src ? (maskBits(src, s, n) & m) : m;
+    switch (op) {
+    case PIXELDUST_COPY:
+      v = (old & ~m) | bits;
+      break;
+    case PIXELDUST_OR:
+      v = old | bits;
+      break;
+    default:
+      v = old & ~bits;
+      break;
+    }
+    if (v == old)
+      continue; // Unchanged (and with PIXELDUST_SPARSE, not allocated)
+#ifdef PIXELDUST_SPARSE
+    if (!(dst = writeWord(k * PIXELDUST_WORD_BITS, y)))
+      continue; // Block couldn't be allocated, skip
+    *dst = v;
+#else
+    r[k] = v;
+#endif
+#ifndef __AVR__
+    if (tiles) {
+      // Count changes for each tile (8 pixels, one byte) of this word
+      for (uint8_t b = 0; b < PIXELDUST_WORD_BITS; b += 8) {
+        uint8_t s = PIXELDUST_WORD_BITS - 8 - b, o = old >> s, n = v >> s;
+        if (o != n)
+          addTiles(k * PIXELDUST_WORD_BITS + b, y,
+                   __builtin_popcount(n) - __builtin_popcount(o));
+      }
+    }
+#endif
+    if (grainMap) {
+      // Same bookkeeping as setPixel() or clearPixel() for changed pixels
+      for (bitmap_word_t c = old ^ v; c;) {
+        uint8_t b = leadingZeros(c);
+        bitmap_word_t bit = (bitmap_word_t)1 << (PIXELDUST_WORD_BITS - 1 - b);
+        dimension_t px = k * PIXELDUST_WORD_BITS + b;
+        c &= ~bit;
+        if (v & bit) {
+          grainMap[(size_t)y * width + px] = PIXELDUST_OBSTACLE;
+        } else {
+          grainMap[(size_t)y * width + px] = PIXELDUST_EMPTY;
+          if (rest)
+            wakeAround(px, y);
+        }
+      }
+    }
+  }
+}
+
+void Adafruit_PixelDust::blit(const uint8_t *mask, dimension_t w,
+                              dimension_t h, int16_t x, int16_t y,
+                              pixeldust_op_t op, uint16_t maskStride) {
+  if (!maskStride)
+    maskStride = (w + 7) / 8;
+  // Clip mask to grid
+  int32_t x0 = x, y0 = y, x1 = x0 + w, y1 = y0 + h;
+  if (x0 < 0)
+    x0 = 0;
+  if (y0 < 0)
+    y0 = 0;
+  if (x1 > width)
+    x1 = width;
+  if (y1 > height)
+    y1 = height;
+  if ((x0 >= x1) || (y0 >= y1))
+    return;
+  for (int32_t yy = y0; yy < y1; yy++) {
+    rowOp(yy, x0, x1 - x0, &mask[(size_t)(yy - y) * maskStride], x0 - x, op);
+#ifdef PIXELDUST_SPARSE
+    // Share blocks left all empty or all set as each row of blocks is
+    // done, so a big area isn't all allocated at once
+    if (((yy & BLOCK_MASK) == BLOCK_MASK) || (yy == y1 - 1))
+      shareBlocks(x0, yy & ~BLOCK_MASK, x1, yy + 1);
+#endif
+  }
+}
+
+void Adafruit_PixelDust::fillRect(dimension_t x, dimension_t y, dimension_t w,
+                                  dimension_t h, bool set) {
+  if ((x >= width) || (y >= height) || !w || !h)
+    return;
+  if (w > width - x)
+    w = width - x;
+  if (h > height - y)
+    h = height - y;
+  for (dimension_t y1 = y + h; y < y1; y++) {
+    rowOp(y, x, w, NULL, 0, set ? PIXELDUST_OR : PIXELDUST_ANDNOT);
+#ifdef PIXELDUST_SPARSE
+    if (((y & BLOCK_MASK) == BLOCK_MASK) || (y == y1 - 1)) // As in blit()
+      shareBlocks(x, y & ~BLOCK_MASK, x + w, y + 1);
+#endif
+  }
+}
+
+/*! 1-axis elastic bounce, e is elasticity of the grain being moved */
+#define BOUNCE(n) n = ((-n) * e / 256)
+
+#ifndef __AVR__
+
+// When a grain is blocked, what happens depends only on the direction it
+// moved (one pixel at most on each axis) and, if diagonally, which axis
+// is faster and whether the two pixels beside the blocked one are free:
+// it keeps moving along one axis if that pixel's free (faster axis
+// first), else stops.  So the decision is precomputed for every case and
+// moveGrain() does one lookup in place of nested tests and branches.
+// Index is dir * 8 + xFaster * 4 + sideX * 2 + sideY, with dir =
+// (dy + 1) * 3 + (dx + 1), sideX the pixel at (newx, oldy) and sideY at
+// (oldx, newy); only dir matters for straight moves.  Each entry is a
+// set of RESOLVE_* bits.  AVR keeps the branches, to save the RAM.
+
+#define RESOLVE_X 1 ///< Collision table: cancel & bounce X motion
+#define RESOLVE_Y 2 ///< Collision table: cancel & bounce Y motion
+
+static struct ResolveTable {
+  uint8_t entry[9 * 2 * 4];
+  ResolveTable(void) {
+    for (int8_t dy = -1; dy <= 1; dy++) {
+      for (int8_t dx = -1; dx <= 1; dx++) {
+        for (uint8_t k = 0; k < 8; k++) {
+          bool fast = k & 4, sideX = k & 2, sideY = k & 1;
+          uint8_t r;
+          if (!dy)
+            r = RESOLVE_X; // Moving horizontally, cancel X (Y is OK)
+          else if (!dx)
+            r = RESOLVE_Y; // Vertically, cancel Y (X is OK)
+          else if (fast ? !sideX : sideY)
+            r = sideX ? RESOLVE_X | RESOLVE_Y : RESOLVE_Y; // Skid along X
+          else
+            r = sideY ? RESOLVE_X | RESOLVE_Y : RESOLVE_X; // Skid along Y
+          entry[((dy + 1) * 3 + dx + 1) * 8 + k] = r;
+        }
+      }
+    }
+  }
+} resolveTable;
+
+#endif // !__AVR__
+
+// Sorting direction for each of the 8 octants, as X & Y weights.  Rather
+// than using true position along acceleration vector (which would be
+// computationally expensive), an 8-way approximation is 'good enough' and
+// quick to compute.  Grains are ordered by descending (x * dx + y * dy).
+static const int8_t sortDir[8][2] = {{1, 0},  {1, 1},   {0, 1},  {-1, 1},
+                                     {-1, 0}, {-1, -1}, {0, -1}, {1, -1}};
+
+// Sort key for grain i along the current direction (descending = bottom first)
+#define SORT_KEY(i) ((int32_t)GX(i) * dx + (int32_t)GY(i) * dy)
+
+// Full sort of a list of grain indices by descending key.  Grain data
+// never moves; only the (smaller) index list is rearranged.
+#ifdef __AVR__
+
+// Heapsort in place: no merge space on AVR, and no recursion.  A min-heap
+// is built so that repeatedly moving the root to the end leaves the list
+// in descending order.
+void Adafruit_PixelDust::sortIndices(grain_count_t *a, grain_count_t n,
+                                     grain_count_t *tmp, int8_t dx,
+                                     int8_t dy) {
+  (void)tmp;
+  uint16_t start = n / 2, end = n, root, child;
+  grain_count_t g;
+  int32_t key;
+  while (end > 1) {
+    if (start) {
+      g = a[--start]; // Building heap
+    } else {
+      g = a[--end]; // Extracting: move root to end, sift last item down
+      a[end] = a[0];
+    }
+    key = SORT_KEY(g);
+    for (root = start; (child = root * 2 + 1) < end; root = child) {
+      if ((child + 1 < end) && (SORT_KEY(a[child + 1]) < SORT_KEY(a[child])))
+        child++;
+      if (SORT_KEY(a[child]) >= key)
+        break;
+      a[root] = a[child];
+    }
+    a[root] = g;
+  }
+}
+
+#else
+
+// Insertion sort of short runs, then bottom-up merge passes alternating
+// between a[] and tmp[] (n entries).  Stable, so grains with equal keys
+// keep their prior order and the incremental sort below stays cheap.
+void Adafruit_PixelDust::sortIndices(grain_count_t *a, grain_count_t n,
+                                     grain_count_t *tmp, int8_t dx,
+                                     int8_t dy) {
+  const size_t run = 16;
+  size_t i, j, lo, mid, hi, width;
+  grain_count_t g, *src = a, *dst = tmp, *t;
+  int32_t key;
+
+  for (lo = 0; lo < n; lo += run) {
+    hi = (lo + run < n) ? lo + run : n;
+    for (i = lo + 1; i < hi; i++) {
+      g = a[i];
+      key = SORT_KEY(g);
+      for (j = i; (j > lo) && (SORT_KEY(a[j - 1]) < key); j--)
+        a[j] = a[j - 1];
+      a[j] = g;
+    }
+  }
+
+  for (width = run; width < n; width *= 2) {
+    for (lo = 0; lo < n; lo += width * 2) {
+      mid = (lo + width < n) ? lo + width : n;
+      hi = (mid + width < n) ? mid + width : n;
+      i = lo;
+      j = mid;
+      size_t out = lo;
+      if ((i < mid) && (j < hi)) {
+        int32_t kl = SORT_KEY(src[i]), kr = SORT_KEY(src[j]);
+        for (;;) {
+          if (kl >= kr) { // Left first when equal, for stability
+            dst[out++] = src[i++];
+            if (i == mid)
+              break;
+            kl = SORT_KEY(src[i]);
+          } else {
+            dst[out++] = src[j++];
+            if (j == hi)
+              break;
+            kr = SORT_KEY(src[j]);
+          }
+        }
+      }
+      while (i < mid)
+        dst[out++] = src[i++];
+      while (j < hi)
+        dst[out++] = src[j++];
+    }
+    t = src;
+    src = dst;
+    dst = t;
+  }
+  if (src != a)
+    memcpy(a, src, n * sizeof(grain_count_t));
+}
+
+#endif // !__AVR__
+
+// Grains barely move between frames, so last frame's order is usually
+// almost right and can be repaired in close to linear time, vs. sorting
+// from scratch every frame.  A full sort is only done when the direction
+// of gravity changes, or if the order has been shuffled too much (e.g.
+// display was shaken) for the repair to be worthwhile.
+void Adafruit_PixelDust::sortGrains(uint8_t q) {
+  int8_t dx = sortDir[q][0], dy = sortDir[q][1];
+
+  if (q != sortOctant) { // Gravity direction changed, full rebuild
+    sortIndices(order, n_grains, sortBuf, dx, dy);
+    sortOctant = q;
+    return;
+  }
+
+  grain_count_t i;
+  int32_t key;
+
+#ifdef __AVR__
+
+  // Grain counts are small on AVR, and there's no RAM to spare for
+  // a merge buffer, so an insertion sort is used.  It gives up after
+  // a fixed amount of work and lets heapsort finish the job instead.
+  uint16_t moves = 0, maxMoves = n_grains * 4;
+  grain_count_t j, g;
+
+  for (i = 1; i < n_grains; i++) {
+    g = order[i];
+    key = SORT_KEY(g);
+    if (key <= SORT_KEY(order[i - 1]))
+      continue; // Already in order (the common case)
+    j = i;
+    do {
+      order[j] = order[j - 1];
+      j--;
+    } while (j && (key > SORT_KEY(order[j - 1])));
+    order[j] = g;
+    if ((moves += i - j) > maxMoves) { // Too far out of order,
+      sortIndices(order, n_grains, NULL, dx, dy);
+      return; // give up and start over
+    }
+  }
+
+#else
+
+  // Insertion sort degrades badly on wide playfields, where a grain
+  // changing rows must hop over every other grain in that row.  Instead,
+  // any grain found out of order is pulled out (along with the grain it
+  // was compared against), leaving a sorted run in place.  The few
+  // displaced grains are sorted on their own and merged back in.
+  grain_count_t kept = 0, // Grains remaining in sorted run
+      moved = 0,          // Grains pulled out into sortBuf[]
+      maxMoved = n_grains / 4;
+  int32_t last = 0; // Key of order[kept - 1]
+
+  for (i = 0; i < n_grains; i++) {
+    key = SORT_KEY(order[i]);
+    if (kept && (key > last)) {
+      if (moved >= maxMoved) {
+        // Too far out of order.  Put the displaced grains back
+        // (anywhere, order doesn't matter) and start over.
+        memcpy(&order[kept], sortBuf, moved * sizeof(grain_count_t));
+        sortIndices(order, n_grains, sortBuf, dx, dy);
+        return;
+      }
+      sortBuf[moved++] = order[--kept];
+      sortBuf[moved++] = order[i];
+      if (kept)
+        last = SORT_KEY(order[kept - 1]);
+    } else {
+      order[kept++] = order[i];
+      last = key;
+    }
+  }
+
+  if (moved) {
+    // Merge space for the displaced grains is the rest of sortBuf[]
+    sortIndices(sortBuf, moved, &sortBuf[moved], dx, dy);
+    // Merge from the end, so grains in the sorted run only move once
+    grain_count_t *out = &order[n_grains - 1];
+    while (moved) {
+      if (kept && (SORT_KEY(order[kept - 1]) < SORT_KEY(sortBuf[moved - 1])))
+        *out-- = order[--kept];
+      else
+        *out-- = sortBuf[--moved];
+    }
+  }
+
+#endif // !__AVR__
+}
+
+#ifdef PIXELDUST_FIXED_POINT
+
+// Integer square root (floor), bit-at-a-time.  No multiplies or divides,
+// which matters on AVR & Cortex-M0.
+static uint16_t isqrt(uint32_t n) {
+  uint32_t root = 0, bit = 1UL << 30;
+  while (bit > n)
+    bit >>= 2;
+  while (bit) {
+    if (n >= root + bit) {
+      n -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root;
+}
+
+#else
+
+// Scale velocity component c (of a vector with squared magnitude v2,
+// magnitude v) to terminal velocity, i.e. 256 * c / v rounded toward
+// zero.  The floating-point estimate is well within 1/2 of the exact
+// quotient (even with -Ofast's approximate divide & square root), so
+// rounded to nearest it's either the result or one too high, which an
+// exact integer test then corrects.  Results don't depend on compiler
+// options and match the SIMD code in accelBlock(), and the clipped vector
+// can't exceed 256 even by rounding.
+static inline velocity_t clipComponent(velocity_t c, float v, int32_t v2) {
+  int32_t a = (c < 0) ? -c : c, q = (int32_t)(256.0f * (float)a / v + 0.5f);
+  q -= ((int64_t)q * q * v2 > (int64_t)a * a * 65536); // One too high?
+  return (c < 0) ? -q : q;
+}
+
+#endif // PIXELDUST_FIXED_POINT
+
+// Terminal velocity (in any direction) is 256 units -- equal to
+// 1 pixel -- which keeps moving grains from passing through each other
+// and other such mayhem.  Though it takes some extra math, velocity is
+// clipped as a 2D vector (not separately-limited X & Y) so that
+// diagonal movement isn't faster than horizontal/vertical.
+static inline void terminalVelocity(velocity_t *vx, velocity_t *vy) {
+  int32_t v2 = (int32_t)*vx * *vx + (int32_t)*vy * *vy; // Velocity squared
+  if (v2 > 65536) { // If v^2 > 65536, then v > 256
+#ifdef PIXELDUST_FIXED_POINT
+    // Integer magnitude, then one divide for a 16.16 fixed-point scale
+    // factor.  Magnitude is rounded down, but never below |vx| or |vy|,
+    // so results still can't exceed 256.
+    uint32_t r = 0x1000000UL / isqrt(v2); // 256 / v, 16.16 fixed point
+    *vx = (*vx < 0) ? -(int16_t)((uint32_t)-*vx * r >> 16)
+                    : (int16_t)((uint32_t)*vx * r >> 16);
+    *vy = (*vy < 0) ? -(int16_t)((uint32_t)-*vy * r >> 16)
+                    : (int16_t)((uint32_t)*vy * r >> 16);
+#else
+    float v = sqrt((float)v2);       // Velocity vector magnitude
+    *vx = clipComponent(*vx, v, v2); // Maintain heading &
+    *vy = clipComponent(*vy, v, v2); // limit magnitude
+#endif
+  }
+}
+
+// Determine one of 8 directions (0 = +X, 2 = +Y, 4 = -X, 6 = -Y, odd
+// values are diagonals) for sorting, from acceleration X & Y.
+static uint8_t octant(int16_t ax, int16_t ay) {
+#ifdef PIXELDUST_FIXED_POINT
+  // Compare |y|/|x| against tan(22.5) and tan(67.5) degrees, the
+  // boundaries between octants, as 8-bit fractions (106/256 ~= 0.414).
+  int32_t x = abs(ax), y = abs(ay);
+  if (y * 256 <= x * 106)
+    return (ax < 0) ? 4 : 0;
+  if (x * 256 <= y * 106)
+    return (ay < 0) ? 6 : 2;
+  if (ax > 0)
+    return (ay > 0) ? 1 : 7;
+  return (ay > 0) ? 3 : 5;
+#else
+  int8_t q;
+  q = (int)(atan2(ay, ax) * 8.0 / M_PI); // -8 to +8
+  if (q >= 0)
+    q = (q + 1) / 2;
+  else
+    q = (q + 16) / 2;
+  if (q > 7)
+    q = 7;
+  return q;
+#endif
+}
+
+#ifdef PIXELDUST_SOA
+
+// Helpers for accelBlock(), the same math as clipComponent() a vector at
+// a time.  For each 32-bit lane, xxxOver() returns a mask of lanes where
+// q^2 * v2 > a2 * 65536, i.e. where q is more than 256 * |c| / |v| (a2 =
+// c^2, v2 = |v|^2).  Those products need up to 49 bits, so they're done as
+// 64-bit even & odd lanes.  xxxScale() estimates q with a floating-point
+// divide by s (|v|, or 1/|v| on 32-bit ARM) rounded to nearest, then
+// steps it down by one where that exact test says it's too high.
+// xxxClip() does this for a whole vector of 16-bit velocity components c,
+// restoring each one's sign.
+#if defined(SIMD_AVX2)
+static inline __m256i avxOver(__m256i q, __m256i v2, __m256i a2) {
+  const __m256i scale = _mm256_set1_epi32(65536);
+  __m256i q2 = _mm256_madd_epi16(q, q), // 0 <= q < 32768, so this is q * q
+      even = _mm256_cmpgt_epi64(_mm256_mul_epu32(q2, v2),
+                                _mm256_mul_epu32(a2, scale)),
+      odd = _mm256_cmpgt_epi64(
+          _mm256_mul_epu32(_mm256_srli_epi64(q2, 32),
+                           _mm256_srli_epi64(v2, 32)),
+          _mm256_mul_epu32(_mm256_srli_epi64(a2, 32), scale));
+  return _mm256_blend_epi32(even, odd, 0xAA);
+}
+
+static inline __m256i avxScale(__m256i a, __m256i v2, __m256 s) {
+  __m256i q = _mm256_cvttps_epi32(_mm256_add_ps(
+      _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_slli_epi32(a, 8)), s),
+      _mm256_set1_ps(0.5f)));
+  return _mm256_add_epi32(q, avxOver(q, v2, _mm256_madd_epi16(a, a)));
+}
+
+static inline __m256i avxClip(__m256i c, __m256i v2lo, __m256i v2hi,
+                              __m256 slo, __m256 shi) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i a = _mm256_abs_epi16(c),
+          q = _mm256_packs_epi32(
+              avxScale(_mm256_unpacklo_epi16(a, zero), v2lo, slo),
+              avxScale(_mm256_unpackhi_epi16(a, zero), v2hi, shi));
+  return _mm256_sign_epi16(q, c);
+}
+#elif defined(SIMD_SSE2)
+static inline __m128i sseOver(__m128i q, __m128i v2, __m128i a2) {
+  const __m128i scale = _mm_set1_epi32(65536),
+                high = _mm_set_epi32(-1, 0, -1, 0);
+  // No 64-bit compare in SSE2, so subtract and take the sign bits from
+  // the high halves
+  __m128i q2 = _mm_madd_epi16(q, q), // 0 <= q < 32768, so this is q * q
+      even = _mm_sub_epi64(_mm_mul_epu32(a2, scale), _mm_mul_epu32(q2, v2)),
+      odd = _mm_sub_epi64(
+          _mm_mul_epu32(_mm_srli_epi64(a2, 32), scale),
+          _mm_mul_epu32(_mm_srli_epi64(q2, 32), _mm_srli_epi64(v2, 32)));
+  return _mm_or_si128(_mm_srli_epi64(_mm_srai_epi32(even, 31), 32),
+                      _mm_and_si128(_mm_srai_epi32(odd, 31), high));
+}
+
+static inline __m128i sseScale(__m128i a, __m128i v2, __m128 s) {
+  __m128i q = _mm_cvttps_epi32(
+      _mm_add_ps(_mm_div_ps(_mm_cvtepi32_ps(_mm_slli_epi32(a, 8)), s),
+                 _mm_set1_ps(0.5f)));
+  return _mm_add_epi32(q, sseOver(q, v2, _mm_madd_epi16(a, a)));
+}
+
+static inline __m128i sseClip(__m128i c, __m128i v2lo, __m128i v2hi,
+                              __m128 slo, __m128 shi) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sign = _mm_srai_epi16(c, 15), // -1 where c < 0
+      a = _mm_sub_epi16(_mm_xor_si128(c, sign), sign),
+      q = _mm_packs_epi32(sseScale(_mm_unpacklo_epi16(a, zero), v2lo, slo),
+                          sseScale(_mm_unpackhi_epi16(a, zero), v2hi, shi));
+  return _mm_sub_epi16(_mm_xor_si128(q, sign), sign);
+}
+#elif defined(SIMD_NEON)
+static inline int32x4_t neonOver(int32x4_t q, int32x4_t v2, int32x4_t a2) {
+  uint32x4_t q2 = vreinterpretq_u32_s32(vmulq_s32(q, q)),
+             v = vreinterpretq_u32_s32(v2), a = vreinterpretq_u32_s32(a2);
+  // Sign of a2 * 65536 - q^2 * v2, as in sseOver()
+  int64x2_t lo = vsubq_s64(
+                vreinterpretq_s64_u64(vshll_n_u32(vget_low_u32(a), 16)),
+                vreinterpretq_s64_u64(
+                    vmull_u32(vget_low_u32(q2), vget_low_u32(v)))),
+            hi = vsubq_s64(
+                vreinterpretq_s64_u64(vshll_n_u32(vget_high_u32(a), 16)),
+                vreinterpretq_s64_u64(
+                    vmull_u32(vget_high_u32(q2), vget_high_u32(v))));
+  return vcombine_s32(vmovn_s64(vshrq_n_s64(lo, 63)),
+                      vmovn_s64(vshrq_n_s64(hi, 63)));
+}
+
+static inline int32x4_t neonScale(int32x4_t a, int32x4_t v2, float32x4_t s) {
+  float32x4_t f = vcvtq_f32_s32(vshlq_n_s32(a, 8));
+#if defined(__aarch64__)
+  f = vdivq_f32(f, s);
+#else
+  f = vmulq_f32(f, s);
+#endif
+  int32x4_t q = vcvtq_s32_f32(vaddq_f32(f, vdupq_n_f32(0.5f)));
+  return vaddq_s32(q, neonOver(q, v2, vmulq_s32(a, a)));
+}
+
+static inline int16x8_t neonClip(int16x8_t c, int32x4_t v2lo,
+                                 int32x4_t v2hi, float32x4_t slo,
+                                 float32x4_t shi) {
+  int16x8_t a = vabsq_s16(c),
+            q = vcombine_s16(
+                vmovn_s32(neonScale(vmovl_s16(vget_low_s16(a)), v2lo, slo)),
+                vmovn_s32(neonScale(vmovl_s16(vget_high_s16(a)), v2hi, shi)));
+  return vbslq_s16(vcltq_s16(c, vdupq_n_s16(0)), vnegq_s16(q), q);
+}
+#endif
+
+// Vectorized velocity pass for the structure-of-arrays layout.  Adds
+// acceleration plus per-grain jitter (jx, jy) to n grain velocities and
+// applies terminalVelocity(), 8 (SSE2, NEON) or 16 (AVX2) grains at a
+// time, with the same results as the scalar code (see clipComponent()).
+// Any grains left over at the end are handled one at a time.
+static void accelBlock(velocity_t *vx, velocity_t *vy, const int16_t *jx,
+                       const int16_t *jy, uint8_t n, int16_t ax, int16_t ay) {
+  uint8_t i = 0;
+
+#if defined(SIMD_AVX2)
+  const __m256i axv = _mm256_set1_epi16(ax), ayv = _mm256_set1_epi16(ay),
+                limit = _mm256_set1_epi32(65536);
+  for (; i + 16 <= n; i += 16) {
+    __m256i x = _mm256_loadu_si256((__m256i *)&vx[i]),
+            y = _mm256_loadu_si256((__m256i *)&vy[i]);
+    x = _mm256_add_epi16(
+        x, _mm256_add_epi16(axv, _mm256_loadu_si256((__m256i *)&jx[i])));
+    y = _mm256_add_epi16(
+        y, _mm256_add_epi16(ayv, _mm256_loadu_si256((__m256i *)&jy[i])));
+    // Interleave X & Y so multiply-add yields vx^2+vy^2 per 32-bit lane.
+    // Unpack & pack both work within 128-bit halves, so order is kept.
+    __m256i xylo = _mm256_unpacklo_epi16(x, y),
+            xyhi = _mm256_unpackhi_epi16(x, y),
+            v2lo = _mm256_madd_epi16(xylo, xylo),
+            v2hi = _mm256_madd_epi16(xyhi, xyhi),
+            mask = _mm256_packs_epi32(_mm256_cmpgt_epi32(v2lo, limit),
+                                      _mm256_cmpgt_epi32(v2hi, limit));
+    if (!_mm256_testz_si256(mask, mask)) { // Any over the limit?
+      __m256 slo = _mm256_sqrt_ps(_mm256_cvtepi32_ps(v2lo)),
+             shi = _mm256_sqrt_ps(_mm256_cvtepi32_ps(v2hi));
+      x = _mm256_blendv_epi8(x, avxClip(x, v2lo, v2hi, slo, shi), mask);
+      y = _mm256_blendv_epi8(y, avxClip(y, v2lo, v2hi, slo, shi), mask);
+    }
+    _mm256_storeu_si256((__m256i *)&vx[i], x);
+    _mm256_storeu_si256((__m256i *)&vy[i], y);
+  }
+#elif defined(SIMD_SSE2)
+  const __m128i axv = _mm_set1_epi16(ax), ayv = _mm_set1_epi16(ay),
+                limit = _mm_set1_epi32(65536);
+  for (; i + 8 <= n; i += 8) {
+    __m128i x = _mm_loadu_si128((__m128i *)&vx[i]),
+            y = _mm_loadu_si128((__m128i *)&vy[i]);
+    x = _mm_add_epi16(x,
+                      _mm_add_epi16(axv, _mm_loadu_si128((__m128i *)&jx[i])));
+    y = _mm_add_epi16(y,
+                      _mm_add_epi16(ayv, _mm_loadu_si128((__m128i *)&jy[i])));
+    // Interleave X & Y so multiply-add yields vx^2+vy^2 per 32-bit lane
+    __m128i xylo = _mm_unpacklo_epi16(x, y), xyhi = _mm_unpackhi_epi16(x, y),
+            v2lo = _mm_madd_epi16(xylo, xylo),
+            v2hi = _mm_madd_epi16(xyhi, xyhi),
+            mask = _mm_packs_epi32(_mm_cmpgt_epi32(v2lo, limit),
+                                   _mm_cmpgt_epi32(v2hi, limit));
+    if (_mm_movemask_epi8(mask)) { // Any over the limit?
+      __m128 slo = _mm_sqrt_ps(_mm_cvtepi32_ps(v2lo)),
+             shi = _mm_sqrt_ps(_mm_cvtepi32_ps(v2hi));
+      x = _mm_or_si128(
+          _mm_and_si128(mask, sseClip(x, v2lo, v2hi, slo, shi)),
+          _mm_andnot_si128(mask, x));
+      y = _mm_or_si128(
+          _mm_and_si128(mask, sseClip(y, v2lo, v2hi, slo, shi)),
+          _mm_andnot_si128(mask, y));
+    }
+    _mm_storeu_si128((__m128i *)&vx[i], x);
+    _mm_storeu_si128((__m128i *)&vy[i], y);
+  }
+#elif defined(SIMD_NEON)
+  const int16x8_t axv = vdupq_n_s16(ax), ayv = vdupq_n_s16(ay);
+  const int32x4_t limit = vdupq_n_s32(65536);
+  for (; i + 8 <= n; i += 8) {
+    int16x8_t x = vaddq_s16(vld1q_s16(&vx[i]),
+                            vaddq_s16(axv, vld1q_s16(&jx[i]))),
+              y = vaddq_s16(vld1q_s16(&vy[i]),
+                            vaddq_s16(ayv, vld1q_s16(&jy[i])));
+    int16x4_t xlo = vget_low_s16(x), xhi = vget_high_s16(x),
+              ylo = vget_low_s16(y), yhi = vget_high_s16(y);
+    int32x4_t v2lo = vmlal_s16(vmull_s16(xlo, xlo), ylo, ylo),
+              v2hi = vmlal_s16(vmull_s16(xhi, xhi), yhi, yhi);
+    uint16x8_t mask = vcombine_u16(vmovn_u32(vcgtq_s32(v2lo, limit)),
+                                   vmovn_u32(vcgtq_s32(v2hi, limit)));
+    uint64x2_t any = vreinterpretq_u64_u16(mask);
+    if (vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) { // Over limit?
+      float32x4_t flo = vcvtq_f32_s32(v2lo), fhi = vcvtq_f32_s32(v2hi);
+#if defined(__aarch64__)
+      float32x4_t slo = vsqrtq_f32(flo), shi = vsqrtq_f32(fhi);
+#else
+      // No divide or square root on 32-bit NEON; reciprocal square root
+      // estimate plus two Newton-Raphson steps is well within the error
+      // that neonScale() corrects for.
+      float32x4_t slo = vrsqrteq_f32(flo), shi = vrsqrteq_f32(fhi);
+      slo = vmulq_f32(slo, vrsqrtsq_f32(vmulq_f32(flo, slo), slo));
+      shi = vmulq_f32(shi, vrsqrtsq_f32(vmulq_f32(fhi, shi), shi));
+      slo = vmulq_f32(slo, vrsqrtsq_f32(vmulq_f32(flo, slo), slo));
+      shi = vmulq_f32(shi, vrsqrtsq_f32(vmulq_f32(fhi, shi), shi));
+#endif
+      x = vbslq_s16(mask, neonClip(x, v2lo, v2hi, slo, shi), x);
+      y = vbslq_s16(mask, neonClip(y, v2lo, v2hi, slo, shi), y);
+    }
+    vst1q_s16(&vx[i], x);
+    vst1q_s16(&vy[i], y);
+  }
+#endif
+
+  for (; i < n; i++) { // Leftovers, or all if no SIMD support
+    vx[i] += ax + jx[i];
+    vy[i] += ay + jy[i];
+    terminalVelocity(&vx[i], &vy[i]);
+  }
+}
+
+#endif // PIXELDUST_SOA
+
+// Apply 2D accel vector (plus jitter from generator r) to the velocities
+// of grains first through last-1
+void Adafruit_PixelDust::accelGrains(grain_count_t first, grain_count_t last,
+                                     int16_t ax, int16_t ay, int16_t az2,
+                                     Adafruit_PixelDust_RNG *r) {
+  if (material) {
+    accelMaterial(NULL, first, last - first, ax, ay, az2, r);
+    return;
+  }
+  grain_count_t i;
+#ifdef PIXELDUST_SOA
+  // Random jitter is generated (in the same sequence as the scalar loop
+  // below) a block at a time, then added in with the SIMD code.
+  int16_t jx[64], jy[64];
+  uint8_t n;
+  for (i = first; i < last; i += n) {
+    n = (last - i > 64) ? 64 : last - i;
+    r->fill(jx, jy, n, az2);
+    accelBlock(&gvx[i], &gvy[i], jx, jy, n, ax, ay);
+  }
+#else
+  for (i = first; i < last; i++) {
+    grain[i].vx += ax + r->bounded(az2);
+    grain[i].vy += ay + r->bounded(az2);
+    terminalVelocity(&grain[i].vx, &grain[i].vy);
+  }
+#endif
+}
+
+// Same as accelGrains(), for a list of grain indices (scalar code only)
+void Adafruit_PixelDust::accelList(const grain_count_t *list,
+                                   grain_count_t count, int16_t ax,
+                                   int16_t ay, int16_t az2,
+                                   Adafruit_PixelDust_RNG *r) {
+  if (material) {
+    accelMaterial(list, 0, count, ax, ay, az2, r);
+    return;
+  }
+  while (count--) {
+    grain_count_t i = *list++;
+    GVX(i) += ax + r->bounded(az2);
+    GVY(i) += ay + r->bounded(az2);
+    terminalVelocity(&GVX(i), &GVY(i));
+  }
+}
+
+// accelGrains() or accelList() (list NULL for grains first to
+// first+count-1) when grains have materials, scaling acceleration and
+// jitter for each.  Scaled input has the middle of the jitter range
+// subtracted (see scaleInput()), so that's added back before scaling
+// acceleration, and the material's own subtracted.  Materials with
+// gravity and jitter of 128 move exactly like grains without materials.
+void Adafruit_PixelDust::accelMaterial(const grain_count_t *list,
+                                       grain_count_t first,
+                                       grain_count_t count, int16_t ax,
+                                       int16_t ay, int16_t az2,
+                                       Adafruit_PixelDust_RNG *r) {
+  int16_t mx[PIXELDUST_MAX_MATERIALS], my[PIXELDUST_MAX_MATERIALS],
+      mz[PIXELDUST_MAX_MATERIALS], az = az2 / 2;
+  for (uint8_t m = 0; m < nMaterials; m++) {
+    int16_t j = az * materials[m].jitter / 128;
+    mx[m] = (int32_t)(ax + az) * materials[m].gravity / 128 - j;
+    my[m] = (int32_t)(ay + az) * materials[m].gravity / 128 - j;
+    mz[m] = j * 2 + 1;
+  }
+  while (count--) {
+    grain_count_t i = list ? *list++ : first++;
+    uint8_t m = material[i];
+    GVX(i) += mx[m] + r->bounded(mz[m]);
+    GVY(i) += my[m] + r->bounded(mz[m]);
+    terminalVelocity(&GVX(i), &GVY(i));
+  }
+}
+
+// Update position of one grain, checking for collisions (see iterate()).
+// Returns MOVE_* bits for what happened.  If MOVE_CHANGED (the grain moved
+// to a different pixel), the move is also recorded in c (unless NULL).
+inline uint8_t Adafruit_PixelDust::moveGrain(grain_count_t i,
+                                             GrainChange *c) {
+  position_t newx, newy;
+#ifdef __AVR__
+  int16_t oldidx, newidx, delta;
+#else
+  int32_t oldidx, newidx;
+#endif
+
+  if (GX(i) < 0)
+    return 0; // Not placed yet (see allocGrains())
+  newx = GX(i) + GVX(i); // New position in grain space
+  newy = GY(i) + GVY(i);
+  position_t tryx = newx, tryy = newy; // Intended position, before bounce
+  uint8_t e = material ? materials[material[i]].elasticity : elasticity;
+  uint8_t result = 0;
+  if (newx < 0) {   // If grain would go out of bounds
+    newx = 0;       // keep it inside,
+    BOUNCE(GVX(i)); // and bounce off wall
+    result = MOVE_WALL;
+  } else if (newx > xMax) {
+    newx = xMax;
+    BOUNCE(GVX(i));
+    result = MOVE_WALL;
+  }
+  if (newy < 0) {
+    newy = 0;
+    BOUNCE(GVY(i));
+    result = MOVE_WALL;
+  } else if (newy > yMax) {
+    newy = yMax;
+    BOUNCE(GVY(i));
+    result = MOVE_WALL;
+  }
+
+  // oldidx/newidx are the prior and new pixel index for this grain.
+  // It's a little easier to check motion vs handling X & Y separately.
+  oldidx = (GY(i) / 256) * width + (GX(i) / 256);
+  newidx = (newy / 256) * width + (newx / 256);
+
+#ifdef __AVR__
+  if ((oldidx != newidx) && // If grain is moving to a new pixel...
+      getPixel(newx / 256, newy / 256)) { // but if pixel already occupied...
+    result |= MOVE_BLOCKED;
+    delta = abs(newidx - oldidx); // What direction when blocked?
+    if (delta == 1) {             // 1 pixel left or right)
+      newx = GX(i);               // Cancel X motion
+      BOUNCE(GVX(i));             // and bounce X velocity (Y is OK)
+    } else if (delta == width) {  // 1 pixel up or down
+      newy = GY(i);               // Cancel Y motion
+      BOUNCE(GVY(i));             // and bounce Y velocity (X is OK)
+    } else {                      // Diagonal intersection is more tricky...
+      // Try skidding along just one axis of motion if possible
+      // (start w/faster axis).
+      if (abs(GVX(i)) >= abs(GVY(i))) {           // X axis is faster
+        if (!getPixel(newx / 256, GY(i) / 256)) { // newx, oldy
+          // That pixel's free!  Take it!  But...
+          newy = GY(i);   // Cancel Y motion
+          BOUNCE(GVY(i)); // and bounce Y velocity
+          result |= MOVE_SKID;
+        } else { // X pixel is taken, so try Y...
+          if (!getPixel(GX(i) / 256, newy / 256)) { // oldx, newy
+            // Pixel is free, take it, but first...
+            newx = GX(i);   // Cancel X motion
+            BOUNCE(GVX(i)); // and bounce X velocity
+            result |= MOVE_SKID;
+          } else {        // Both spots are occupied
+            newx = GX(i); // Cancel X & Y motion
+            newy = GY(i);
+            BOUNCE(GVX(i)); // Bounce X & Y velocity
+            BOUNCE(GVY(i));
+          }
+        }
+      } else { // Y axis is faster, start there
+        if (!getPixel(GX(i) / 256, newy / 256)) { // oldx, newy
+          // Pixel's free!  Take it!  But...
+          newx = GX(i);   // Cancel X motion
+          BOUNCE(GVX(i)); // and bounce X velocity
+          result |= MOVE_SKID;
+        } else { // Y pixel is taken, so try X...
+          if (!getPixel(newx / 256, GY(i) / 256)) { // newx, oldy
+            // Pixel is free, take it, but first...
+            newy = GY(i);   // Cancel Y motion
+            BOUNCE(GVY(i)); // and bounce Y velocity
+            result |= MOVE_SKID;
+          } else {        // Both spots are occupied
+            newx = GX(i); // Cancel X & Y motion
+            newy = GY(i);
+            BOUNCE(GVX(i)); // Bounce X & Y velocity
+            BOUNCE(GVY(i));
+          }
+        }
+      }
+    }
+  }
+#else
+  if ((oldidx != newidx) && // If grain is moving to a new pixel...
+      getPixel(newx / 256, newy / 256)) { // but if pixel already occupied...
+    // Look up what to do (see ResolveTable)
+    dimension_t ox = GX(i) / 256, oy = GY(i) / 256, nx = newx / 256,
+                ny = newy / 256;
+    uint8_t k = ((ny - oy + 1) * 3 + nx - ox + 1) * 8;
+    result |= MOVE_BLOCKED;
+    if ((nx != ox) && (ny != oy)) { // Diagonal, sides matter
+      k += (abs(GVX(i)) >= abs(GVY(i))) * 4 + getPixel(nx, oy) * 2 +
+           getPixel(ox, ny);
+      if (resolveTable.entry[k] != (RESOLVE_X | RESOLVE_Y))
+        result |= MOVE_SKID;
+    }
+    uint8_t r = resolveTable.entry[k];
+    if (r & RESOLVE_X) {
+      newx = GX(i);   // Cancel X motion
+      BOUNCE(GVX(i)); // and bounce X velocity
+    }
+    if (r & RESOLVE_Y) {
+      newy = GY(i);   // Cancel Y motion
+      BOUNCE(GVY(i)); // and bounce Y velocity
+    }
+  }
+#endif
+#ifdef PIXELDUST_SPARSE
+  // Moving in or out of a shared block makes a copy of it first (see
+  // writeWord()); if that can't be done, the grain stays put as if blocked
+  if (((newy / 256) * width + (newx / 256) != oldidx) &&
+      (!writeWord(GX(i) / 256, GY(i) / 256) ||
+       !writeWord(newx / 256, newy / 256))) {
+    newx = GX(i);
+    newy = GY(i);
+    BOUNCE(GVX(i));
+    BOUNCE(GVY(i));
+    result |= MOVE_BLOCKED;
+  }
+#endif
+  dimension_t oldx = GX(i) / 256, oldy = GY(i) / 256;
+  GX(i) = newx; // Update grain position
+  GY(i) = newy;
+  newidx = (newy / 256) * width + (newx / 256);
+  if (newidx == oldidx) { // Same pixel, nothing else to do, except...
+    if (rest) {
+      // Grains that haven't changed pixel in a while, and are up against
+      // something, go to sleep (see enableSleep())
+      if (rest[i] < sleepFrames) {
+        rest[i]++;
+      } else if (((newx != tryx) || (newy != tryy)) &&
+                 supported(oldx, oldy)) {
+        rest[i] = GRAIN_ASLEEP;
+        GVX(i) = GVY(i) = 0;
+      }
+    }
+    return result;
+  }
+  if (rest)
+    rest[i] = 0;
+  clearBit(oldx, oldy);           // Clear old spot
+  setBit(newx / 256, newy / 256); // Set new spot
+#ifndef __AVR__
+  if (tiles && (((oldx ^ (newx / 256)) | (oldy ^ (newy / 256))) >> TILE_SHIFT))
+    moveTiles(oldx, oldy, newx / 256, newy / 256); // Changed tiles
+#endif
+  if (grainMap) {
+    grainMap[oldidx] = PIXELDUST_EMPTY;
+    grainMap[newidx] = i;
+  }
+  if (c) {
+    c->grain = i;
+    c->oldX = oldx;
+    c->oldY = oldy;
+    c->newX = newx / 256;
+    c->newY = newy / 256;
+  }
+  return result | MOVE_CHANGED;
+}
+
+uint8_t Adafruit_PixelDust::advance(uint32_t elapsed, int16_t ax, int16_t ay,
+                                    int16_t az) {
+  stepTime += elapsed;
+  // Time beyond maxSteps is dropped, so a slow frame doesn't make the
+  // next one slower still
+  if (stepTime / stepPeriod > maxSteps)
+    stepTime = maxSteps * stepPeriod + stepTime % stepPeriod;
+  uint8_t steps = stepTime / stepPeriod;
+  if (!steps) {
+    nChanges = 0; // Nothing moved
+    return 0;
+  }
+
+  int16_t az2 = scaleInput(&ax, &ay, az);
+
+  if (changes && (steps > 1) && !merged) { // First use, alloc merge space
+    merged = (GrainChange *)malloc(n_grains * sizeof(GrainChange));
+    size_t bytes = (size_t)width * height * sizeof(grain_count_t);
+    if ((mergeSlot = (grain_count_t *)malloc(bytes)))
+      memset(mergeSlot, 0xFF, bytes); // All PIXELDUST_EMPTY
+    if (!merged || !mergeSlot) {
+      free(merged);
+      free(mergeSlot);
+      merged = NULL;
+      mergeSlot = NULL;
+      steps = 1; // No room to merge change lists, just do one step
+    }
+  }
+  stepTime -= steps * stepPeriod; // Any steps not run are left for later
+
+  if (steps == 1) {
+    step(ax, ay, az2);
+    return 1;
+  }
+
+  if (!sort && !changes && !rest
+#ifdef PIXELDUST_THREADS
+      && !workers
+#endif
+#ifdef PIXELDUST_STATS
+      && !stats // Stats are per step, so steps must be separate
+#endif
+  ) {
+    // Simple case, sub-steps are combined into one pass over the grains
+    // per step: each grain's velocity for the next step is updated just
+    // after it's moved (other grains' moves don't affect it), a block at
+    // a time so the SIMD velocity pass still applies.
+    grain_count_t i, j, end;
+    accelGrains(0, n_grains, ax, ay, az2, &rng);
+    for (uint8_t s = 1; s < steps; s++) {
+      for (i = 0; i < n_grains; i = end) {
+        end = (n_grains - i > 64) ? i + 64 : n_grains;
+        for (j = i; j < end; j++)
+          moveGrain(j, NULL);
+        accelGrains(i, end, ax, ay, az2, &rng);
+      }
+    }
+    for (i = 0; i < n_grains; i++)
+      moveGrain(i, NULL);
+    return steps;
+  }
+
+  // Otherwise, one full step at a time.  If keeping a change list, each
+  // step's changes are merged into one list with one entry per grain,
+  // from its pixel before the first step to its pixel after the last.
+  // Entries are matched up by pixel (a change starting where an earlier
+  // one ended is the same grain), so only pixels moved through are
+  // touched; mergeSlot[] holds the merged entry ending at each pixel.
+  grain_count_t nMerged = 0, k, slot;
+  GrainChange *c;
+  for (uint8_t s = 0; s < steps; s++) {
+    step(ax, ay, az2);
+    if (!merged)
+      continue;
+    // Pixels can be vacated and refilled in the same step, in any order
+    // in the list, so all lookups are done before any new entries in
+    // mergeSlot[].  Each change's grain field is reused to hold its slot.
+    for (k = 0; k < nChanges; k++) {
+      c = &changes[k];
+      pixel_index_t from = (pixel_index_t)c->oldY * width + c->oldX;
+      if ((slot = mergeSlot[from]) == PIXELDUST_EMPTY) {
+        merged[slot = nMerged++] = *c;
+      } else {
+        mergeSlot[from] = PIXELDUST_EMPTY;
+        merged[slot].grain = c->grain;
+        merged[slot].newX = c->newX;
+        merged[slot].newY = c->newY;
+      }
+      c->grain = slot;
+    }
+    for (k = 0; k < nChanges; k++) {
+      c = &changes[k];
+      mergeSlot[(pixel_index_t)c->newY * width + c->newX] = c->grain;
+    }
+  }
+  if (merged) {
+    // Clear mergeSlot[] for next time, and drop grains that came back to
+    // the pixel they started from (they didn't change pixel after all)
+    for (nChanges = k = 0; k < nMerged; k++) {
+      c = &merged[k];
+      mergeSlot[(pixel_index_t)c->newY * width + c->newX] = PIXELDUST_EMPTY;
+      if ((c->newX != c->oldX) || (c->newY != c->oldY))
+        merged[nChanges++] = *c;
+    }
+    c = changes; // Swap lists, merged one is now current
+    changes = merged;
+    merged = c;
+  }
+  return steps;
+}
+
+// Single-threaded iterate() when sleeping is enabled: same as the usual
+// velocity and position passes, but only for grains in the active list.
+// Grains that fall asleep are dropped from the list, then any sleeping
+// grains next to a pixel that was vacated are woken (and added back).
+void Adafruit_PixelDust::iterateActive(int16_t ax, int16_t ay, int16_t az2) {
+  grain_count_t i, k, kept = 0;
+  accelList(active, nActive, ax, ay, az2, &rng);
+  STATS_MARK(accelTime);
+  for (nChanges = k = 0; k < nActive; k++) {
+    i = active[k];
+    uint8_t m = moveGrain(i, &changes[nChanges]);
+    nChanges += m & MOVE_CHANGED;
+    COUNT_MOVE(moveCount, m);
+    if (rest[i] != GRAIN_ASLEEP)
+      active[kept++] = i;
+  }
+  nActive = kept;
+  wakeChanged();
+}
+
+// Convert 0xRRGGBB color to render() pixel format
+static uint32_t renderColor(uint32_t c, pixeldust_format_t format) {
+  uint8_t r = c >> 16, g = c >> 8, b = c;
+  switch (format) {
+  case PIXELDUST_RGB565:
+    return ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
+  case PIXELDUST_GRAY8: // Approx. luma, weights sum to 256
+    return ((uint16_t)r * 77 + (uint16_t)g * 150 + (uint16_t)b * 29) >> 8;
+  default:
+    return c;
+  }
+}
+
+// Store one render() pixel (format is the same for the whole pass, so the
+// switch is well predicted)
+static inline void renderPixel(void *buf, pixeldust_format_t format,
+                               pixel_index_t i, uint32_t c) {
+  switch (format) {
+  case PIXELDUST_RGB888: {
+    uint8_t *p = &((uint8_t *)buf)[i * 3];
+    p[0] = c >> 16;
+    p[1] = c >> 8;
+    p[2] = c;
+  } break;
+  case PIXELDUST_RGB565:
+    ((uint16_t *)buf)[i] = c;
+    break;
+  default:
+    ((uint8_t *)buf)[i] = c;
+    break;
+  }
+}
+
+void Adafruit_PixelDust::render(void *buf, pixeldust_format_t format,
+                                const GrainColor *colors, uint8_t nColors,
+                                uint32_t obstacleColor,
+                                const pixel_index_t *remap) const {
+  pixel_index_t idx;
+  uint32_t c;
+
+  // Obstacles: every set pixel in the bitmap, which also includes grains
+  // (drawn over afterward)
+  if (obstacleColor != PIXELDUST_NO_COLOR) {
+    c = renderColor(obstacleColor, format);
+    dimension_t x, y;
+    for (y = 0; y < height; y++) {
+#ifdef __AVR__
+      for (x = 0; x < width; x++) {
+        if (getPixel(x, y)) {
+          idx = y * width + x;
+          renderPixel(buf, format, remap ? remap[idx] : idx, c);
+        }
+      }
+#else
+      // Scan a word at a time, skipping empty space quickly
+      for (dimension_t k = 0; k < stride; k++) {
+        for (bitmap_word_t w = *readWord(k * PIXELDUST_WORD_BITS, y); w;
+             w &= ~pixelBit(x)) {
+          x = k * PIXELDUST_WORD_BITS + leadingZeros(w);
+          idx = (pixel_index_t)y * width + x;
+          renderPixel(buf, format, remap ? remap[idx] : idx, c);
+        }
+      }
+#endif
+    }
+  }
+
+  // Grains, one run of indices per color
+  static const GrainColor white = {0, 0xFFFFFF};
+  if (!colors) {
+    colors = &white;
+    nColors = 1;
+  }
+  for (uint8_t k = 0; k < nColors; k++) {
+    c = renderColor(colors[k].color, format);
+    grain_count_t i = colors[k].first,
+                  end = (k < nColors - 1) ? colors[k + 1].first : n_grains;
+    if (end > n_grains)
+      end = n_grains;
+    for (; i < end; i++) {
+      if (GX(i) < 0)
+        continue; // Not placed yet (see allocGrains())
+      idx = (pixel_index_t)(GY(i) / 256) * width + GX(i) / 256;
+      renderPixel(buf, format, remap ? remap[idx] : idx, c);
+    }
+  }
+}
+
+// Calculate one frame of particle interactions
+void Adafruit_PixelDust::iterate(int16_t ax, int16_t ay, int16_t az) {
+  int16_t az2 = scaleInput(&ax, &ay, az);
+  step(ax, ay, az2);
+}
+
+// Scale raw accelerometer input for step(), returns range of random motion
+int16_t Adafruit_PixelDust::scaleInput(int16_t *ax, int16_t *ay,
+                                       int16_t az) const {
+  *ax = (int32_t)*ax * scale / 256;     // Scale down raw accelerometer
+  *ay = (int32_t)*ay * scale / 256;     // inputs to manageable range.
+  az = abs((int32_t)az * scale / 2048); // Z is further scaled down 1:8
+  // A tiny bit of random motion is applied to each grain, so that tall
+  // stacks of pixels tend to topple (else the whole stack slides across
+  // the display).  This is a function of the Z axis input, so it's more
+  // pronounced the more the display is tilted (else the grains shift
+  // around too much when the display is held level).
+  az = (az >= 4) ? 1 : 5 - az; // Clip & invert
+  *ax -= az;                   // Subtract Z motion factor from X, Y,
+  *ay -= az;                   // then...
+  return az * 2 + 1;           // max random motion to add back in
+}
+
+// One frame of iterate(), or one sub-step of advance(), with input
+// already scaled.  az2 is the range of random jitter.
+void Adafruit_PixelDust::step(int16_t ax, int16_t ay, int16_t az2) {
+  grain_count_t i;
+
+  if (rest) {
+    // Sleeping grains all wake if gravity changes by more than about 1/8
+    // (7 degrees or so of tilt) since the last time this happened.
+    if (abs(ax - sleepAx) + abs(ay - sleepAy) >
+        (abs(sleepAx) + abs(sleepAy)) / 8 + 1) {
+      wakeAll();
+      sleepAx = ax;
+      sleepAy = ay;
+      sleepDir = (ax || ay) ? octant(ax, ay) : 0xFF;
+    }
+  }
+
+#ifdef PIXELDUST_STATS
+  memset(moveCount, 0, sizeof(moveCount));
+  if (stats)
+    stats->mark = statsNow();
+#endif
+
+  if (order) {
+    sortGrains(octant(ax, ay)); // Sort grains by position, bottom-to-top
+    if (rest) { // Active list follows sorted order too
+      grain_count_t k;
+      for (nActive = k = 0; k < n_grains; k++) {
+        i = order[k];
+        if (rest[i] != GRAIN_ASLEEP)
+          active[nActive++] = i;
+      }
+    }
+  }
+  STATS_MARK(sortTime);
+
+#ifdef PIXELDUST_THREADS
+  if (workers) {
+    iterateThreaded(ax, ay, az2);
+    STATS_RECORD();
+    return;
+  }
+#endif
+
+  if (rest) {
+    iterateActive(ax, ay, az2);
+    STATS_RECORD();
+    return;
+  }
+
+  // Apply 2D accel vector to grain velocities...
+  accelGrains(0, n_grains, ax, ay, az2, &rng);
+  STATS_MARK(accelTime);
+
+  // ...then update position of each grain, one at a time, checking for
+  // collisions and having them react.  This really seems like it shouldn't
+  // work, as only one grain is considered at a time while the rest are
+  // regarded as stationary.  Yet this naive algorithm, taking many not-
+  // technically-quite-correct steps, and repeated quickly enough,
+  // visually integrates into something that somewhat resembles physics.
+  // (I'd initially tried implementing this as a bunch of concurrent and
+  // "realistic" elastic collisions among circular grains, but the
+  // calculations and volume of code quickly got out of hand for both
+  // the tiny 8-bit AVR microcontroller and my tiny dinosaur brain.)
+
+  uint8_t m;
+  if (order) {
+    nChanges = 0;
+    for (grain_count_t k = 0; k < n_grains; k++) {
+      i = order[k];
+      m = moveGrain(i, changes ? &changes[nChanges] : NULL);
+      if (changes)
+        nChanges += m & MOVE_CHANGED;
+      COUNT_MOVE(moveCount, m);
+    }
+  } else if (changes) {
+    for (nChanges = i = 0; i < n_grains; i++) {
+      m = moveGrain(i, &changes[nChanges]);
+      nChanges += m & MOVE_CHANGED;
+      COUNT_MOVE(moveCount, m);
+    }
+  } else {
+    for (i = 0; i < n_grains; i++) {
+      m = moveGrain(i, NULL);
+      COUNT_MOVE(moveCount, m);
+    }
+  }
+  STATS_RECORD();
+}
+
+#ifdef PIXELDUST_THREADS
+
+#define MAX_THREADS 64 ///< Upper limit for setThreads()
+
+// Tasks run by each thread in iterate(), see runTask()
+enum { TASK_ACCEL, TASK_MOVE_EVEN, TASK_MOVE_ODD };
+
+// Argument passed to each worker thread
+struct WorkerArg {
+  Adafruit_PixelDust_Workers *w; // Pool the thread belongs to
+  uint8_t t;                     // Thread number (1 to nThreads-1)
+};
+
+// Thread pool state for iterate().  Thread 0 is whichever thread calls
+// iterate(); the others wait on a condition variable for each new task.
+struct Adafruit_PixelDust_Workers {
+  Adafruit_PixelDust *sand; // Simulation this pool works on
+  uint8_t nThreads,         // Total threads, including thread 0
+      nBands,               // Bands this frame (2 per thread if tall enough)
+      task,                 // Current TASK_* value
+      pending,              // Worker threads yet to finish task
+      nStarted;             // Worker threads successfully created
+  bool quit;                // Set when shutting down
+  uint32_t generation;      // Incremented for each new task
+  pthread_mutex_t lock;     // Guards task, pending, quit and generation
+  pthread_cond_t go,        // Signalled when a task is started
+      done;                 // Signalled when the last worker finishes
+  pthread_t thread[MAX_THREADS];           // Worker threads (1 to N-1)
+  WorkerArg arg[MAX_THREADS];              // Arguments to same
+  Adafruit_PixelDust_RNG rng[MAX_THREADS]; // Per-thread jitter generators
+  int16_t ax, ay, az2;                     // Inputs to TASK_ACCEL
+  uint32_t bandStart[MAX_THREADS * 2 + 1]; // Band b is index[bandStart[b]]
+                                           // to index[bandStart[b+1]-1]
+  grain_count_t bandChanges[MAX_THREADS * 2]; // Change list count per band
+  grain_count_t *index;                    // Grain indices, grouped by band
+  uint32_t *rowCount;                      // Grains in each pixel row
+  uint8_t *rowBand;                        // Band number of each pixel row
+#ifdef PIXELDUST_STATS
+  uint32_t moveCount[MAX_THREADS][16]; // Per thread, as sand->moveCount
+#endif
+};
+
+// Tell worker threads to quit, wait for them to finish, free pool
+static void freeWorkers(Adafruit_PixelDust_Workers *w) {
+  pthread_mutex_lock(&w->lock);
+  w->quit = true;
+  pthread_cond_broadcast(&w->go);
+  pthread_mutex_unlock(&w->lock);
+  for (uint8_t t = 1; t <= w->nStarted; t++)
+    pthread_join(w->thread[t], NULL);
+  pthread_cond_destroy(&w->done);
+  pthread_cond_destroy(&w->go);
+  pthread_mutex_destroy(&w->lock);
+  free(w->index);
+  free(w->rowCount);
+  free(w->rowBand);
+  delete w;
+}
+
+bool Adafruit_PixelDust::setThreads(uint8_t n) {
+  if (workers) {
+    freeWorkers(workers);
+    workers = NULL;
+  }
+  if (n > MAX_THREADS)
+    n = MAX_THREADS;
+  if ((n < 2) || (height < 4))
+    return true; // Single-threaded
+
+  Adafruit_PixelDust_Workers *w = new Adafruit_PixelDust_Workers();
+  w->sand = this;
+  w->nThreads = n;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->go, NULL);
+  pthread_cond_init(&w->done, NULL);
+  w->index = (grain_count_t *)calloc(n_grains + 1, sizeof(grain_count_t));
+  w->rowCount = (uint32_t *)malloc(height * sizeof(uint32_t));
+  w->rowBand = (uint8_t *)malloc(height);
+  if (w->index && w->rowCount && w->rowBand) {
+    for (uint8_t t = 1; t < n; t++) {
+      w->arg[t].w = w;
+      w->arg[t].t = t;
+      if (pthread_create(&w->thread[t], NULL, workerThread, &w->arg[t]))
+        break;
+      w->nStarted = t;
+    }
+    if (w->nStarted == n - 1) {
+      workers = w;
+      return true;
+    }
+  }
+  freeWorkers(w); // Stops any threads that did start
+  return false;
+}
+
+// Worker thread loop: wait for a task, run it, report when done
+void *Adafruit_PixelDust::workerThread(void *arg) {
+  Adafruit_PixelDust_Workers *w = ((WorkerArg *)arg)->w;
+  uint8_t t = ((WorkerArg *)arg)->t;
+  uint32_t seen = 0; // No tasks are started before all threads exist
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (!w->quit && (w->generation == seen))
+      pthread_cond_wait(&w->go, &w->lock);
+    if (w->quit)
+      break;
+    seen = w->generation;
+    pthread_mutex_unlock(&w->lock);
+    w->sand->runTask(t);
+    pthread_mutex_lock(&w->lock);
+    if (!--w->pending)
+      pthread_cond_signal(&w->done);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+// Run a task on all threads (calling thread is thread 0), return when done
+void Adafruit_PixelDust::runAll(uint8_t task) {
+  Adafruit_PixelDust_Workers *w = workers;
+  pthread_mutex_lock(&w->lock);
+  w->task = task;
+  w->pending = w->nThreads - 1;
+  w->generation++;
+  pthread_cond_broadcast(&w->go);
+  pthread_mutex_unlock(&w->lock);
+  runTask(0);
+  pthread_mutex_lock(&w->lock);
+  while (w->pending)
+    pthread_cond_wait(&w->done, &w->lock);
+  pthread_mutex_unlock(&w->lock);
+}
+
+// Thread t's share of the current task
+void Adafruit_PixelDust::runTask(uint8_t t) {
+  Adafruit_PixelDust_Workers *w = workers;
+  if (w->task == TASK_ACCEL) {
+    // Velocities are independent, so grains are simply split evenly
+    grain_count_t count = rest ? nActive : n_grains,
+                  first = (uint64_t)count * t / w->nThreads,
+                  last = (uint64_t)count * (t + 1) / w->nThreads;
+    if (rest)
+      accelList(&active[first], last - first, w->ax, w->ay, w->az2,
+                &w->rng[t]);
+    else
+      accelGrains(first, last, w->ax, w->ay, w->az2, &w->rng[t]);
+  } else {
+    uint8_t b = t * 2 + (w->task == TASK_MOVE_ODD);
+    if (b < w->nBands) {
+      uint32_t k = w->bandStart[b], end = w->bandStart[b + 1];
+      if (changes) {
+        // Each band records changes in its own part of the list (a band
+        // can't have more changes than grains), compacted afterward.
+        GrainChange *c = &changes[k];
+        for (; k < end; k++) {
+          uint8_t m = moveGrain(w->index[k], c);
+          c += m & MOVE_CHANGED;
+          COUNT_MOVE(w->moveCount[t], m);
+        }
+        w->bandChanges[b] = c - &changes[w->bandStart[b]];
+      } else {
+        for (; k < end; k++) {
+          uint8_t m = moveGrain(w->index[k], NULL);
+          COUNT_MOVE(w->moveCount[t], m);
+        }
+      }
+    }
+  }
+}
+
+// Multithreaded equivalent of the velocity and position passes in
+// iterate().  The playfield is split into horizontal bands, at least two
+// pixel rows each.  A grain moves at most one pixel per axis per frame,
+// so the rows it can read or write are those of its own band plus one row
+// either side.  Even-numbered bands are updated concurrently (one per
+// thread), then odd-numbered bands; with bands at least two rows tall, no
+// two bands in the same pass touch a common row (and rows don't share
+// bitmap words), so no locking is needed.  A grain that crosses into the
+// next band during the even pass isn't moved again in the odd pass, as
+// grains are assigned to bands once, at the start of the frame.
+void Adafruit_PixelDust::iterateThreaded(int16_t ax, int16_t ay,
+                                         int16_t az2) {
+  Adafruit_PixelDust_Workers *w = workers;
+  grain_count_t i;
+  dimension_t y, y0;
+  uint8_t b;
+
+  // Velocity pass.  Each thread's jitter generator is seeded from the
+  // main one, so results are repeatable for a given thread count.
+  for (b = 0; b < w->nThreads; b++)
+    w->rng[b].seed(rng.next());
+  w->ax = ax;
+  w->ay = ay;
+  w->az2 = az2;
+  runAll(TASK_ACCEL);
+  STATS_MARK(accelTime);
+
+  // Choose band edges so each band has about the same number of grains
+  // (sand tends to pile up at one side), then group grains by band,
+  // preserving their order within each band (for sorting).
+  // With sleeping enabled, only active grains are considered.
+  grain_count_t k, count = rest ? nActive : n_grains;
+  memset(w->rowCount, 0, height * sizeof(uint32_t));
+  for (k = 0; k < count; k++) {
+    i = rest ? active[k] : (order ? order[k] : k);
+    w->rowCount[GY(i) / 256]++;
+  }
+  w->nBands = w->nThreads * 2;
+  if (w->nBands > height / 2)
+    w->nBands = height / 2;
+  uint32_t sum = 0, pos[MAX_THREADS * 2];
+  for (b = 0, y = y0 = 0; y < height; y++) {
+    // Start the next band here if the current one has its share of grains,
+    // or if the remaining rows are only just enough for the other bands.
+    if ((b < w->nBands - 1) && (y - y0 >= 2) &&
+        ((sum >= (uint64_t)count * (b + 1) / w->nBands) ||
+         (height - y <= 2 * (w->nBands - 1 - b)))) {
+      w->bandStart[++b] = sum;
+      y0 = y;
+    }
+    w->rowBand[y] = b;
+    sum += w->rowCount[y];
+  }
+  w->bandStart[0] = 0;
+  w->bandStart[w->nBands] = count;
+  memcpy(pos, w->bandStart, w->nBands * sizeof(uint32_t));
+  for (k = 0; k < count; k++) {
+    i = rest ? active[k] : (order ? order[k] : k);
+    w->index[pos[w->rowBand[GY(i) / 256]]++] = i;
+  }
+
+  // Position pass, even bands then odd
+#ifdef PIXELDUST_STATS
+  memset(w->moveCount, 0, w->nThreads * sizeof(w->moveCount[0]));
+#endif
+  runAll(TASK_MOVE_EVEN);
+  runAll(TASK_MOVE_ODD);
+#ifdef PIXELDUST_STATS
+  for (b = 0; b < w->nThreads; b++) {
+    for (uint8_t m = 0; m < 16; m++)
+      moveCount[m] += w->moveCount[b][m];
+  }
+#endif
+
+  if (changes) { // Gather each band's changes into one list
+    for (nChanges = b = 0; b < w->nBands; b++) {
+      memmove(&changes[nChanges], &changes[w->bandStart[b]],
+              w->bandChanges[b] * sizeof(GrainChange));
+      nChanges += w->bandChanges[b];
+    }
+  }
+
+  if (rest) { // Remove grains that fell asleep, wake others
+    for (nActive = k = 0; k < count; k++) {
+      if (rest[i = w->index[k]] != GRAIN_ASLEEP)
+        active[nActive++] = i;
+    }
+    wakeChanged();
+  }
+}
+
+// Background runner state, see startRunner().  Frames are passed from the
+// simulation thread to the renderer through three buffers: the runner
+// fills 'back', the renderer reads 'front', and the two swap with
+// 'middle', which carries FRAME_NEW while it holds a frame not yet seen.
+// Each side only ever touches its own buffer, so neither waits.
+struct Adafruit_PixelDust_Runner {
+  pthread_t thread;    // Simulation thread
+  bool quit;           // Set to stop the thread
+  uint32_t period;     // Microseconds per frame
+  uint64_t input;      // Packed X/Y/Z input, see setInput()
+  GrainFrame frame[3]; // Triple buffer
+  uint8_t back,        // Buffer being filled (runner thread only)
+      front,           // Buffer being drawn (getFrame() thread only)
+      middle;          // Buffer in between, swapped atomically
+};
+
+#define FRAME_NEW 0x04 ///< Runner 'middle' flag: frame not yet read
+
+void Adafruit_PixelDust::setInput(int16_t ax, int16_t ay, int16_t az) {
+  if (runner)
+    __atomic_store_n(&runner->input,
+                     ((uint64_t)(uint16_t)ax << 32) |
+                         ((uint64_t)(uint16_t)ay << 16) | (uint16_t)az,
+                     __ATOMIC_RELAXED);
+}
+
+// Pixel position of every grain, by index, 2 values per grain.  Grains
+// not placed yet (see allocGrains()) go off the playfield.
+void Adafruit_PixelDust::captureFrame(dimension_t *xy) const {
+  for (grain_count_t i = 0; i < n_grains; i++) {
+    if (GX(i) < 0) {
+      xy[i * 2] = xy[i * 2 + 1] = (dimension_t)~0;
+    } else {
+      xy[i * 2] = GX(i) / 256;
+      xy[i * 2 + 1] = GY(i) / 256;
+    }
+  }
+}
+
+bool Adafruit_PixelDust::startRunner(uint32_t period) {
+  stopRunner();
+  if (!period || !bitmap)
+    return false;
+  Adafruit_PixelDust_Runner *r = new Adafruit_PixelDust_Runner();
+  size_t stride = 2 * (size_t)n_grains; // +1 below so never 0 bytes
+  dimension_t *xy =
+      (dimension_t *)malloc((3 * stride + 1) * sizeof(dimension_t));
+  if (!xy) {
+    delete r;
+    return false;
+  }
+  captureFrame(xy); // Renderer starts with the current state
+  for (uint8_t b = 0; b < 3; b++) {
+    r->frame[b].frame = 0;
+    r->frame[b].xy = &xy[b * stride];
+  }
+  r->front = 0;
+  r->middle = 1;
+  r->back = 2;
+  r->period = period;
+  r->input = 0;
+  r->quit = false;
+  runner = r;
+  if (pthread_create(&r->thread, NULL, runnerThread, this)) {
+    runner = NULL;
+    free(xy);
+    delete r;
+    return false;
+  }
+  return true;
+}
+
+void Adafruit_PixelDust::stopRunner(void) {
+  if (runner) {
+    __atomic_store_n(&runner->quit, true, __ATOMIC_RELAXED);
+    pthread_join(runner->thread, NULL);
+    free((void *)runner->frame[0].xy); // All 3 buffers are one alloc
+    delete runner;
+    runner = NULL;
+  }
+}
+
+const GrainFrame *Adafruit_PixelDust::getFrame(void) {
+  Adafruit_PixelDust_Runner *r = runner;
+  if (!r)
+    return NULL;
+  if (__atomic_load_n(&r->middle, __ATOMIC_ACQUIRE) & FRAME_NEW)
+    r->front = __atomic_exchange_n(&r->middle, r->front, __ATOMIC_ACQ_REL) &
+               ~FRAME_NEW;
+  return &r->frame[r->front];
+}
+
+// Runner thread loop: iterate, publish, wait for the next frame time
+void *Adafruit_PixelDust::runnerThread(void *arg) {
+  Adafruit_PixelDust *sand = (Adafruit_PixelDust *)arg;
+  Adafruit_PixelDust_Runner *r = sand->runner;
+  struct timespec next, now;
+  uint32_t frame = 0;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (!__atomic_load_n(&r->quit, __ATOMIC_RELAXED)) {
+    uint64_t in = __atomic_load_n(&r->input, __ATOMIC_RELAXED);
+    sand->iterate((int16_t)(in >> 32), (int16_t)(in >> 16), (int16_t)in);
+    GrainFrame *f = &r->frame[r->back];
+    sand->captureFrame((dimension_t *)f->xy);
+    f->frame = ++frame;
+    r->back = __atomic_exchange_n(&r->middle, r->back | FRAME_NEW,
+                                  __ATOMIC_ACQ_REL) &
+              ~FRAME_NEW;
+    next.tv_nsec += (long)(r->period % 1000000) * 1000;
+    next.tv_sec += r->period / 1000000;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000L;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec > next.tv_sec) ||
+        ((now.tv_sec == next.tv_sec) && (now.tv_nsec > next.tv_nsec)))
+      next = now; // Fell behind, skip ahead
+    else
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+  return NULL;
+}
+
+#endif // PIXELDUST_THREADS
+
+#ifdef PIXELDUST_STATS
+
+bool Adafruit_PixelDust::enableStats(uint16_t frames) {
+  if (stats) {
+    free(stats->ring);
+    delete stats;
+    stats = NULL;
+  }
+  if (!frames)
+    return true;
+  Adafruit_PixelDust_Stats *s = new Adafruit_PixelDust_Stats();
+  if (!(s->ring = (uint32_t *)calloc((size_t)frames * (STATS_WORDS + 1),
+                                     sizeof(uint32_t)))) {
+    delete s;
+    return false;
+  }
+  s->size = frames;
+  stats = s;
+  return true;
+}
+
+// Finish the current frame's stats (at the end of step()) and publish
+// them in the history
+void Adafruit_PixelDust::recordStats(void) {
+  Adafruit_PixelDust_Stats *s = stats;
+  PixelDustStats *f = &s->cur;
+  statsMark(s, &f->moveTime);
+  f->frame = s->head;
+  f->updated = f->moved = f->blocked = f->skids = f->walls = 0;
+  for (uint8_t m = 0; m < 16; m++) {
+    f->updated += moveCount[m];
+    if (m & MOVE_CHANGED)
+      f->moved += moveCount[m];
+    if (m & MOVE_BLOCKED)
+      f->blocked += moveCount[m];
+    if (m & MOVE_SKID)
+      f->skids += moveCount[m];
+    if (m & MOVE_WALL)
+      f->walls += moveCount[m];
+  }
+  // Sleeping grains have no velocity, so only awake ones need adding up
+  uint64_t sum = 0;
+  grain_count_t k, count = rest ? nActive : n_grains;
+  for (k = 0; k < count; k++) {
+    grain_count_t i = rest ? active[k] : k;
+    sum += (int32_t)GVX(i) * GVX(i) + (int32_t)GVY(i) * GVY(i);
+  }
+  f->energy = sum / 2;
+
+  uint32_t words[STATS_WORDS], *slot = &s->ring[(s->head % s->size) *
+                                                 (STATS_WORDS + 1)],
+                               seq = slot[0];
+  memcpy(words, f, sizeof(PixelDustStats));
+  STATS_STORE(&slot[0], seq + 1, __ATOMIC_RELAXED); // Odd: being written
+  STATS_FENCE(__ATOMIC_RELEASE);
+  for (uint8_t w = 0; w < STATS_WORDS; w++)
+    STATS_STORE(&slot[w + 1], words[w], __ATOMIC_RELAXED);
+  STATS_STORE(&slot[0], seq + 2, __ATOMIC_RELEASE);
+  STATS_STORE(&s->head, s->head + 1, __ATOMIC_RELEASE);
+}
+
+bool Adafruit_PixelDust::getStats(PixelDustStats *st, uint16_t age) const {
+  Adafruit_PixelDust_Stats *s = stats;
+  uint32_t words[STATS_WORDS];
+  if (!s)
+    return false;
+  for (;;) {
+    uint32_t n = STATS_LOAD(&s->head, __ATOMIC_ACQUIRE), f;
+    if ((age >= n) || (age >= s->size))
+      return false;
+    f = n - 1 - age; // Frame wanted
+    const uint32_t *slot = &s->ring[(f % s->size) * (STATS_WORDS + 1)];
+    uint32_t seq = STATS_LOAD(&slot[0], __ATOMIC_ACQUIRE);
+    for (uint8_t w = 0; w < STATS_WORDS; w++)
+      words[w] = STATS_LOAD(&slot[w + 1], __ATOMIC_RELAXED);
+    STATS_FENCE(__ATOMIC_ACQUIRE);
+    if (!(seq & 1) && (STATS_LOAD(&slot[0], __ATOMIC_RELAXED) == seq)) {
+      memcpy(st, words, sizeof(PixelDustStats));
+      if (st->frame == f)
+        return true;
+    }
+    // Slot was being written, or has moved on to a newer frame since
+    // 'head' was read; try again
+  }
+}
+
+#endif // PIXELDUST_STATS
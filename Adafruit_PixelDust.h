@@ -24,7 +24,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-/*! Remap Arduino-style random() to stdlib-style. */
+/*! Remap Arduino-style random() to stdlib-style.  Not used by the library
+    itself any more (see Adafruit_PixelDust_RNG), kept for compatibility. */
 #define random(X) (random() % X)
 #endif
 
@@ -41,20 +42,97 @@
 typedef uint8_t dimension_t;   ///< Pixel dimensions
 typedef int16_t position_t;    ///< 'Sand space' coords (256X pixel space)
 typedef uint8_t grain_count_t; ///< Number of grains
+typedef uint16_t pixel_index_t; ///< Pixel index (y * width + x)
 #else
 // Anything non-AVR is presumed more capable, maybe a Cortex M0 or other
 // 32-bit device.  These go up to 32767x32767 pixels and 65535 grains.
-typedef uint16_t dimension_t;   ///< Pixel dimensions
-typedef int32_t position_t;     ///< 'Sand space' coords (256X pixel space)
+// Defining PIXELDUST_WIDE (identically for the library and all code using
+// it, like PIXELDUST_SOA below) raises the grain limit to 4 billion, RAM
+// permitting, for desktop and Raspberry Pi use with millions of grains.
+// Pixel and 'sand space' limits are the same either way.
+// Defining PIXELDUST_COMPACT (again identically everywhere) instead stores
+// positions in 16 bits as on AVR, so each grain takes 8 bytes rather than
+// 12: more grains in a small microcontroller's RAM, and less memory
+// traffic in iterate().  The playfield is then limited to 127x127 pixels
+// as on AVR; begin() fails if it's larger.
+typedef uint16_t dimension_t; ///< Pixel dimensions
+#ifdef PIXELDUST_COMPACT
+typedef int16_t position_t; ///< 'Sand space' coords (256X pixel space)
+#else
+typedef int32_t position_t; ///< 'Sand space' coords (256X pixel space)
+#endif
+#ifdef PIXELDUST_WIDE
+typedef uint32_t grain_count_t; ///< Number of grains
+#else
 typedef uint16_t grain_count_t; ///< Number of grains
 #endif
+typedef uint32_t pixel_index_t; ///< Pixel index (y * width + x)
+#endif
 // Velocity type is same on any architecture -- must allow up to +/- 256
 typedef int16_t velocity_t; ///< Velocity type
 
+// The pixel grid is a bitmap, 1 bit per pixel with the leftmost pixel in
+// the most significant bit, each row padded to a whole number of words.
+// Words are bytes on AVR, else the native register size, so any pixel
+// access is a single aligned load or store, and a row of pixels can be
+// scanned a word at a time.
+#if defined(__AVR__)
+typedef uint8_t bitmap_word_t; ///< Unit of bitmap storage
+#elif UINTPTR_MAX > 0xFFFFFFFFUL
+typedef uint64_t bitmap_word_t; ///< Unit of bitmap storage
+#else
+typedef uint32_t bitmap_word_t; ///< Unit of bitmap storage
+#endif
+#define PIXELDUST_WORD_BITS (sizeof(bitmap_word_t) * 8) ///< Bits per word
+
+/*! Pixel formats for render() */
+typedef enum {
+  PIXELDUST_RGB888, ///< 3 bytes per pixel: red, green, blue
+  PIXELDUST_RGB565, ///< 16 bits per pixel (native byte order), 5/6/5 R/G/B
+  PIXELDUST_GRAY8,  ///< 1 byte per pixel, brightness
+} pixeldust_format_t;
+
+/*!
+    @brief Color for a range of grains, for render().  An array of these,
+    in order of increasing first grain index, colors grains from each
+    entry's first index up to the next entry's.
+*/
+typedef struct {
+  grain_count_t first; ///< First grain index using this color
+  uint32_t color;      ///< Color as 0xRRGGBB, converted to render() format
+} GrainColor;
+
+/*!
+    @brief Physics parameters for one type of grain, see setMaterials().
+*/
+typedef struct {
+  uint8_t elasticity; ///< Bounce (0-255), as for the constructor
+  uint8_t gravity;    ///< Acceleration scale, 128 = normal, 255 = ~2X
+  uint8_t jitter;     ///< Random motion scale, 128 = normal, 0 = none
+} GrainMaterial;
+
+#define PIXELDUST_MAX_MATERIALS 16 ///< Max entries in setMaterials() table
+
+/*! Ways blit() combines a mask with the pixel grid */
+typedef enum {
+  PIXELDUST_COPY,   ///< Mask replaces pixels: set where 1, clear where 0
+  PIXELDUST_OR,     ///< Set pixels where mask is 1, others unchanged
+  PIXELDUST_ANDNOT, ///< Clear pixels where mask is 1, others unchanged
+} pixeldust_op_t;
+
+/*! render() obstacle color to NOT draw obstacles */
+#define PIXELDUST_NO_COLOR 0xFFFFFFFFUL
+
+/*! getGrainAt() value for an empty pixel */
+#define PIXELDUST_EMPTY ((grain_count_t) ~(grain_count_t)0)
+/*! getGrainAt() value for an obstacle pixel (set with setPixel()) */
+#define PIXELDUST_OBSTACLE ((grain_count_t)(PIXELDUST_EMPTY - 1))
+
 /*!
     @brief Per-grain structure holding position and velocity.
     An array of these structures is allocated in the begin() function,
-    one per grain.  8 bytes each on AVR, 12 bytes elsewhere.
+    one per grain.  8 bytes each on AVR or with PIXELDUST_COMPACT, 12 bytes
+    elsewhere.
 */
 typedef struct {
   position_t x;  ///< Horizontal position in 'sand space'
@@ -63,6 +141,185 @@ typedef struct {
   velocity_t vy; ///< Vertical velocity (-255 to +255) in 'sand space'
 } Grain;
 
+/*!
+    @brief One grain that moved to a different pixel during the last call
+    to iterate(), see enableChanges().
+*/
+typedef struct {
+  grain_count_t grain; ///< Grain index (0 to grains-1)
+  dimension_t oldX;    ///< Prior horizontal (x) pixel coordinate
+  dimension_t oldY;    ///< Prior vertical (y) pixel coordinate
+  dimension_t newX;    ///< New horizontal (x) pixel coordinate
+  dimension_t newY;    ///< New vertical (y) pixel coordinate
+} GrainChange;
+
+/*!
+    @brief Grain positions at the end of one simulation frame, published
+    by the background runner (see startRunner() and getFrame()).  Not
+    changed once published, until the renderer asks for a newer one.
+*/
+typedef struct {
+  uint32_t frame;        ///< Frames simulated since startRunner()
+  const dimension_t *xy; ///< X & Y pixel position of each grain (2 per
+                         ///< grain, in grain index order).  Grains not
+                         ///< yet placed have both set to ~0, off the
+                         ///< playfield.
+} GrainFrame;
+
+/*!
+    @brief Statistics for one simulation frame (one call to iterate(), or
+    one step of advance()), see enableStats().  Times are in nanoseconds
+    (with microsecond resolution on Arduino).
+*/
+typedef struct {
+  uint32_t frame;     ///< Frames recorded since enableStats(), from 0
+  uint32_t sortTime;  ///< Time spent sorting grains (0 if not sorting)
+  uint32_t accelTime; ///< Time spent in the velocity pass
+  uint32_t moveTime;  ///< Time spent in the position pass, including
+                      ///< waking grains and splitting work among threads
+  uint32_t updated;   ///< Grains updated (only those awake, if sleeping)
+  uint32_t moved;     ///< Grains that moved to a different pixel
+  uint32_t blocked;   ///< Grains whose next pixel was occupied (they may
+                      ///< still have moved along the other axis)
+  uint32_t skids;     ///< Blocked diagonal moves that slid along one axis
+  uint32_t walls;     ///< Grains that hit an edge of the playfield
+  uint64_t energy;    ///< Kinetic energy estimate: sum of (vx^2+vy^2)/2
+                      ///< over all grains, in velocity units (1/256 pixel
+                      ///< per frame) squared
+} PixelDustStats;
+
+// On microcontrollers without floating-point hardware, iterate() uses
+// integer-only math (for sort direction and velocity clipping) instead of
+// atan2() and sqrt().  Other targets may opt in by defining
+// PIXELDUST_FIXED_POINT, or define PIXELDUST_FLOAT to always use floats.
+#if !defined(PIXELDUST_FIXED_POINT) && !defined(PIXELDUST_FLOAT) &&            \
+    (defined(__AVR__) || defined(__ARM_ARCH_6M__))
+#define PIXELDUST_FIXED_POINT ///< Integer-only math in iterate()
+#endif
+
+// Grains are normally stored as an array of Grain structures. Defining
+// PIXELDUST_SOA instead keeps positions and velocities in four separate
+// arrays ("structure of arrays"), which lets the velocity pass in iterate()
+// use SIMD instructions (SSE2 or AVX2 on x86, NEON on ARM) to process many
+// grains per instruction.  This is only worthwhile for large grain counts
+// on desktop-class or Raspberry Pi systems.  The public API is the same
+// either way, but the symbol must be defined identically for the library
+// and all code using it (e.g. pass -DPIXELDUST_SOA in CXXFLAGS).
+
+// On Linux and similar hosts (anything not built by the Arduino IDE),
+// iterate() can optionally spread its work across several threads, see
+// setThreads().  Define PIXELDUST_NO_THREADS to leave this out (and avoid
+// any dependency on pthreads).
+#if !defined(ARDUINO) && !defined(PIXELDUST_NO_THREADS)
+#define PIXELDUST_THREADS ///< setThreads() is available
+#endif
+
+// Defining PIXELDUST_STATS adds per-frame statistics (phase timings,
+// collision counts and kinetic energy), see enableStats().  Counting
+// costs a little time in iterate() even when not enabled, so it's left
+// out by default.  The symbol must be defined identically for the
+// library and all code using it, as for PIXELDUST_SOA.
+
+// Defining PIXELDUST_SPARSE stores the pixel grid as 64x64 pixel blocks,
+// each allocated only when something is drawn there or a grain moves in.
+// Blocks that are entirely empty or entirely obstacle share one copy of
+// each, so a huge, mostly empty playfield costs memory for the area in
+// use rather than the whole grid.  Every pixel access looks up its block
+// first, so iterate() is somewhat slower; attachSnapshot() isn't
+// available; and per-pixel extras (enableGrainMap(), enableTiles() and
+// the like) still cost memory for the whole grid.  If a block can't be
+// allocated, grains can't enter it and drawing there is skipped.  Not
+// available on AVR.  The symbol must be defined identically for the
+// library and all code using it, as for PIXELDUST_SOA.
+#ifdef PIXELDUST_SPARSE
+#ifdef __AVR__
+#undef PIXELDUST_SPARSE
+#else
+#define PIXELDUST_BLOCK_SHIFT 6 ///< Sparse bitmap blocks are 64x64 pixels
+#define PIXELDUST_BLOCK_WORDS (4096 / PIXELDUST_WORD_BITS) ///< Per block
+#endif
+#endif
+
+struct Adafruit_PixelDust_Workers; // Thread pool state, see setThreads()
+struct Adafruit_PixelDust_Runner;  // Runner state, see startRunner()
+struct Adafruit_PixelDust_Stats;   // Stats history, see enableStats()
+struct Adafruit_PixelDust_Tiles;   // Occupancy summary, see enableTiles()
+
+/*!
+    @brief Small, fast pseudorandom number generator (xorshift32).
+    Each Adafruit_PixelDust object has its own, so simulations don't share
+    (or contend for a lock on) the C library's global random() state, and
+    runs are reproducible from a seed.
+*/
+class Adafruit_PixelDust_RNG {
+public:
+  /*!
+      @brief Constructor, seeds the generator.
+      @param s Seed value (optional, default is 1).
+  */
+  Adafruit_PixelDust_RNG(uint32_t s = 1) { seed(s); }
+
+  /*!
+      @brief Restart the generator's sequence from a given seed.
+      @param s Seed value.  Any value is valid (0 is remapped internally).
+  */
+  void seed(uint32_t s) { state = s ? s : 0x9E3779B9; }
+
+  /*!
+      @brief  Get the generator's current internal state.
+      @return State value; passing this to seed() resumes the sequence
+              from this point.
+  */
+  uint32_t getState(void) const { return state; }
+
+  /*!
+      @brief  Get next raw 32-bit pseudorandom value.
+      @return Value from 1 to 0xFFFFFFFF.
+  */
+  uint32_t next(void) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+
+  /*!
+      @brief  Get next pseudorandom value in a range, like Arduino's
+              random(n) but without a divide.
+      @param  n Upper limit (exclusive), 1 to 65535.
+      @return Value from 0 to n-1.
+  */
+  uint16_t bounded(uint16_t n) { return ((next() >> 16) * n) >> 16; }
+
+  /*!
+      @brief Fill a pair of arrays with pseudorandom values in a range,
+             alternating between them.  Same sequence as calling
+             bounded() for a[0], b[0], a[1], b[1] and so on, but in one
+             call -- used for batches of per-grain X & Y jitter.
+      @param a     First array to fill.
+      @param b     Second array to fill.
+      @param count Number of elements in each array.
+      @param n     Upper limit (exclusive) of values, 1 to 65535.
+  */
+  void fill(int16_t *a, int16_t *b, uint16_t count, uint16_t n) {
+    uint32_t x = state; // Local copy stays in a register
+    while (count--) {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      *a++ = ((x >> 16) * n) >> 16;
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      *b++ = ((x >> 16) * n) >> 16;
+    }
+    state = x;
+  }
+
+private:
+  uint32_t state; // Current state, never 0
+};
+
 /*!
     @brief Particle simulation class for "LED sand."
     This handles the "physics engine" part of a sand/rain simulation.
@@ -78,8 +335,8 @@ public:
       @brief Constructor -- allocates the basic Adafruit_PixelDust object,
              this should be followed with a call to begin() to allocate
              additional data structures within.
-      @param w    Simulation width in pixels (up to 127 on AVR,
-                  32767 on other architectures).
+      @param w    Simulation width in pixels (up to 127 on AVR or with
+                  PIXELDUST_COMPACT, 32767 on other architectures).
       @param h    Simulation height in pixels (same).
       @param n    Number of sand grains (up to 255 on AVR, 65535 elsewhere).
       @param s    Accelerometer scaling (1-255). The accelerometer X, Y and Z
@@ -93,8 +350,12 @@ public:
                   Sorting sometimes (not always) makes the physics less
                   "Looney Tunes," as lower particles get out of the way of
                   upper particles.  It can be computationally expensive if
-                  there's lots of grains, and isn't good if you're coloring
-                  grains by index (because they're constantly reordering).
+                  there's lots of grains.  Grains are processed through a
+                  sorted list of indices, so each grain keeps its index
+                  (and color, material etc.).  Order from the prior frame
+                  is reused, so cost is mostly a function of how much the
+                  grains moved, with a full re-sort only when the
+                  direction of gravity changes.
   */
   Adafruit_PixelDust(dimension_t w, dimension_t h, grain_count_t n, uint8_t s,
                      uint8_t e = 128, bool sort = false);
@@ -109,7 +370,9 @@ public:
       @brief  Allocates additional memory required by the
               Adafruit_PixelDust object before placing elements or
               calling iterate().
-      @return True on success (memory allocated), otherwise false.
+      @return True on success (memory allocated), otherwise false
+              (including, with PIXELDUST_COMPACT, if the playfield is
+              larger than 127x127).
   */
   bool begin(void);
 
@@ -138,6 +401,56 @@ public:
   */
   void clear(void);
 
+  /*!
+      @brief Combine a 1-bit-per-pixel mask with the pixel grid, for
+             placing (or removing) whole obstacle shapes at once.  Much
+             faster than setPixel() per pixel, as pixels are handled a
+             word at a time.  Mask bits outside the grid are ignored.
+             Like setPixel() and clearPixel(), this is for obstacles;
+             don't clear pixels holding grains.
+      @param mask       Mask bitmap in RAM, rows top to bottom, leftmost
+                        pixel of each row in the most significant bit of
+                        its first byte (same as Adafruit_GFX drawBitmap()).
+      @param w          Mask width in pixels.
+      @param h          Mask height in pixels.
+      @param x          Horizontal (x) grid coordinate of mask's left edge,
+                        may be negative or past the right edge.
+      @param y          Vertical (y) grid coordinate of mask's top edge,
+                        may be negative or past the bottom edge.
+      @param op         How mask bits are applied (optional, default is
+                        PIXELDUST_COPY).
+      @param maskStride Bytes per mask row (optional, default is 0,
+                        meaning (w + 7) / 8, rows padded to whole bytes).
+  */
+  void blit(const uint8_t *mask, dimension_t w, dimension_t h, int16_t x,
+            int16_t y, pixeldust_op_t op = PIXELDUST_COPY,
+            uint16_t maskStride = 0);
+
+  /*!
+      @brief Set or clear a horizontal run of pixels, a word at a time.
+             Pixels past the right edge are ignored.
+      @param x   Horizontal (x) coordinate of leftmost pixel.
+      @param y   Vertical (y) coordinate (0 to height-1).
+      @param w   Width in pixels.
+      @param set If true (default), set pixels as obstacles, else clear.
+  */
+  void fillSpan(dimension_t x, dimension_t y, dimension_t w,
+                bool set = true) {
+    fillRect(x, y, w, 1, set);
+  }
+
+  /*!
+      @brief Set or clear a rectangle of pixels, a word at a time.
+             Pixels outside the grid are ignored.
+      @param x   Horizontal (x) coordinate of left edge.
+      @param y   Vertical (y) coordinate of top edge.
+      @param w   Width in pixels.
+      @param h   Height in pixels.
+      @param set If true (default), set pixels as obstacles, else clear.
+  */
+  void fillRect(dimension_t x, dimension_t y, dimension_t w, dimension_t h,
+                bool set = true);
+
   /*!
       @brief  Get value of one pixel on the pixel grid.
       @param  x Horizontal (x) coordinate (0 to width-1).
@@ -145,7 +458,13 @@ public:
       @return true if spot occupied by a grain or obstacle,
               otherwise false.
   */
+#ifdef __AVR__
   bool getPixel(dimension_t x, dimension_t y) const;
+#else
+  bool getPixel(dimension_t x, dimension_t y) const {
+    return *readWord(x, y) & pixelBit(x);
+  }
+#endif
 
   /*!
       @brief  Position one sand grain on the pixel grid.
@@ -165,6 +484,104 @@ public:
   */
   void getPosition(grain_count_t i, dimension_t *x, dimension_t *y) const;
 
+  /*!
+      @brief  Allocate and fill in a map of which grain occupies each
+              pixel, which is then kept up to date by iterate() and other
+              functions, making getGrainAt() a quick lookup rather than a
+              search through every grain.  Call after begin(); the map
+              uses (width * height * sizeof(grain_count_t)) bytes.
+      @return True on success, false if memory could not be allocated or
+              there are too many grains (the last two index values are
+              reserved for PIXELDUST_EMPTY and PIXELDUST_OBSTACLE).
+  */
+  bool enableGrainMap(void);
+
+  /*!
+      @brief  Find which grain, if any, occupies a pixel.  This is much
+              faster if enableGrainMap() has been called.
+      @param  x Horizontal (x) coordinate (0 to width-1).
+      @param  y Vertical (y) coordinate (0 to height-1).
+      @return Grain index (0 to grains-1), or PIXELDUST_EMPTY if the pixel
+              is empty, or PIXELDUST_OBSTACLE if it's an obstacle.
+  */
+  grain_count_t getGrainAt(dimension_t x, dimension_t y) const;
+
+#ifndef __AVR__
+  /*!
+      @brief  Allocate and fill in a summary of how many pixels are set
+              in each 8x8 pixel tile, and in each 8x8 group of tiles and
+              so on up to the whole grid, which is then kept up to date
+              by iterate() and other functions.  countFree(), isEmpty()
+              and findFree() then skip over full and empty areas rather
+              than looking at every pixel, and randomize() can place
+              grains quickly in a nearly full grid (which also changes
+              where it places them).  Call after begin(); the summary
+              uses about (width * height / 64) bytes.  Not available on
+              AVR.
+      @return True on success, false if memory could not be allocated.
+  */
+  bool enableTiles(void);
+
+  /*!
+      @brief  Count pixels that are neither obstacles nor grains in a
+              rectangle.  Much faster with enableTiles().
+      @param  x Horizontal (x) coordinate of left edge.
+      @param  y Vertical (y) coordinate of top edge.
+      @param  w Width in pixels.
+      @param  h Height in pixels.
+      @return Number of free pixels, from the part of the rectangle that's
+              on the grid.
+  */
+  uint32_t countFree(dimension_t x, dimension_t y, dimension_t w,
+                     dimension_t h) const;
+
+  /*!
+      @brief  Count pixels that are neither obstacles nor grains.
+      @return Number of free pixels on the whole grid.
+  */
+  uint32_t countFree(void) const { return countFree(0, 0, width, height); }
+
+  /*!
+      @brief  Check whether a rectangle is free of obstacles and grains.
+              Much faster with enableTiles().
+      @param  x Horizontal (x) coordinate of left edge.
+      @param  y Vertical (y) coordinate of top edge.
+      @param  w Width in pixels.
+      @param  h Height in pixels.
+      @return True if no pixel in the part of the rectangle that's on the
+              grid is set.
+  */
+  bool isEmpty(dimension_t x, dimension_t y, dimension_t w,
+               dimension_t h) const {
+    return !countSet(x, y, w, h);
+  }
+
+  /*!
+      @brief  Find the free pixel nearest to a point, e.g. to add a grain
+              there with setPosition().  Much faster with enableTiles().
+      @param  x  Horizontal (x) coordinate (0 to width-1).
+      @param  y  Vertical (y) coordinate (0 to height-1).
+      @param  fx POINTER to store horizontal (x) coord of free pixel.
+      @param  fy POINTER to store vertical (y) coord of free pixel.
+      @return True on success, false if the grid has no free pixels.
+  */
+  bool findFree(dimension_t x, dimension_t y, dimension_t *fx,
+                dimension_t *fy) const;
+#endif
+
+#ifdef PIXELDUST_SPARSE
+  /*!
+      @brief  Free pixel grid blocks that grains have since left empty,
+              or that are now entirely obstacle, in favor of the shared
+              copies (see PIXELDUST_SPARSE).  blit(), fillRect() and
+              clear() do this for the area they change; grains moving
+              around don't, so call this now and then (not every frame)
+              if they roam widely.
+      @return Bytes of pixel grid storage in use afterward.
+  */
+  size_t compactBitmap(void);
+#endif
+
   /*!
       @brief Randomize grain coordinates. This assigns random starting
              locations to every grain in the simulation, making sure
@@ -172,10 +589,21 @@ public:
              the setPixel() function. The pixel grid should first be
              cleared with the begin() or clear() functions and any
              obstacles then placed with setPixel(); don't randomize()
-             on an already-active field.
+             on an already-active field.  With enableTiles(), if the grid
+             fills up (or with PIXELDUST_SPARSE, memory runs out) this
+             stops, leaving the remaining grains unplaced.
   */
   void randomize(void);
 
+  /*!
+      @brief Seed the random number generator used by randomize() and
+             for jitter in iterate().  Each Adafruit_PixelDust object has
+             its own generator, so runs with the same seed, setup and
+             inputs produce identical results.
+      @param s Seed value.
+  */
+  void seed(uint32_t s) { rng.seed(s); }
+
   /*!
       @brief Run one iteration (frame) of the particle simulation.
       @param ax Accelerometer X input.
@@ -184,18 +612,528 @@ public:
   */
   void iterate(int16_t ax, int16_t ay, int16_t az = 0);
 
+  /*!
+      @brief Set the time step used by advance().
+      @param period   Simulated time per step, in microseconds (optional,
+                      default is 22222, i.e. 45 steps per second).
+      @param maxSteps Maximum steps per call to advance(), 1-255 (optional,
+                      default is 8).  If more time than this has passed,
+                      the excess is dropped (motion slows rather than the
+                      program falling further and further behind).
+  */
+  void setStep(uint32_t period = 1000000L / 45, uint8_t maxSteps = 8) {
+    stepPeriod = period ? period : 1;
+    this->maxSteps = maxSteps ? maxSteps : 1;
+  }
+
+  /*!
+      @brief  Run the simulation for a given amount of elapsed time, as
+              a whole number of fixed-length steps (see setStep()), so
+              motion is the same speed regardless of how often this is
+              called.  Leftover time carries over to the next call.  Each
+              step is equivalent to one iterate(), but where possible
+              (no sorting, sleeping, threads or change list) multiple
+              steps are combined into fewer passes over the grain data.
+              If a change list is enabled, it covers all of the steps
+              (grain position before the first to after the last), and
+              leaves out grains that ended where they started.  If there
+              isn't memory to combine the steps' lists, only one step is
+              run and the rest of the time carries over.
+      @param  elapsed Time since the last call, in microseconds.
+      @param  ax      Accelerometer X input.
+      @param  ay      Accelerometer Y input.
+      @param  az      Accelerometer Z input (optional, default is 0).
+      @return Number of steps run (0 if not enough time has passed; the
+              grains haven't moved and there's no need to redraw).
+  */
+  uint8_t advance(uint32_t elapsed, int16_t ax, int16_t ay, int16_t az = 0);
+
+  /*!
+      @brief Draw all grains, and optionally obstacles, into a buffer in
+             one pass, rather than calling getPosition() and a drawing
+             function for each grain.  Pixels not occupied by grains or
+             obstacles are left unchanged, so clear or fill the buffer
+             with background beforehand.  Grains not placed yet (with
+             randomize() or setPosition()) aren't drawn.  Colors are
+             specified as 0xRRGGBB for any format; for PIXELDUST_GRAY8,
+             brightness is derived from this.
+      @param buf           Buffer, width * height pixels in row-major
+                           order, unless a remap table is used.
+      @param format        Pixel format of buf.
+      @param colors        Grain colors by index range, or NULL to draw
+                           all grains white.
+      @param nColors       Number of elements in colors[].
+      @param obstacleColor Color for pixels set with setPixel(), or
+                           PIXELDUST_NO_COLOR (default) to not draw them.
+      @param remap         Optional table (width * height elements) giving,
+                           for each pixel index (y * width + x), the index
+                           of the corresponding pixel in buf.  For
+                           displays with unusual pixel layouts.
+  */
+  void render(void *buf, pixeldust_format_t format,
+              const GrainColor *colors = NULL, uint8_t nColors = 0,
+              uint32_t obstacleColor = PIXELDUST_NO_COLOR,
+              const pixel_index_t *remap = NULL) const;
+
+  /*!
+      @brief  Let grains that have come to rest go to sleep, so iterate()
+              skips them until something nearby changes.  A grain sleeps
+              once it's stayed in the same pixel for a number of frames
+              while pressed against another grain, an obstacle or an edge,
+              and with no empty pixel below it in the direction of gravity.
+              Sleeping grains wake when a neighboring pixel is vacated
+              (including with clearPixel()) or when gravity changes by
+              more than about 7 degrees, so in mostly-settled scenes the
+              cost of iterate() follows the number of moving grains
+              rather than the total.  This also enables the grain map and
+              change list (see enableGrainMap() and enableChanges()).
+              Sleeping changes the results (a sleeping grain skips its
+              jitter, so later random numbers go to other grains), so a
+              run with sleep enabled can't be checked against one
+              without, e.g. with getHash(); compare runs that both use
+              the same frames setting.
+      @param  frames Frames a grain must be at rest before sleeping,
+                     1 to 254 (optional, default is 8).
+      @return True on success, false if memory could not be allocated
+              or frames is out of range.
+  */
+  bool enableSleep(uint8_t frames = 8);
+
+  /*!
+      @brief  Get the number of grains not sleeping, see enableSleep().
+      @return Number of grains iterate() will update on its next call
+              (or all grains, if sleeping isn't enabled).
+  */
+  grain_count_t getActiveCount(void) const {
+    return rest ? nActive : n_grains;
+  }
+
+  /*!
+      @brief  Give grains differing physics (e.g. bouncy beads among
+              heavy sand) by assigning each a material from a table.  On
+              first call, a material number is allocated for each grain
+              (1 byte each, separate from the grain data), all set to 0;
+              then use setMaterial() to change them.  May be called again
+              to change the table; grains with a material number past the
+              end of a new table revert to 0.  With PIXELDUST_SOA,
+              velocity updates use the scalar code rather than SIMD when
+              materials are in use.
+      @param  table Material parameters, copied; table[0] is the default.
+      @param  n     Number of entries in table, 1 to
+                    PIXELDUST_MAX_MATERIALS.
+      @return True on success, false if memory could not be allocated
+              or n is out of range.
+  */
+  bool setMaterials(const GrainMaterial *table, uint8_t n);
+
+  /*!
+      @brief Set the material of one grain, see setMaterials().
+      @param i Grain index (0 to grains-1).
+      @param m Material number, index into setMaterials() table.
+  */
+  void setMaterial(grain_count_t i, uint8_t m) {
+    if (material && (m < nMaterials))
+      material[i] = m;
+  }
+
+  /*!
+      @brief  Get the material of one grain, see setMaterials().
+      @param  i Grain index (0 to grains-1).
+      @return Material number (0 if materials aren't in use).
+  */
+  uint8_t getMaterial(grain_count_t i) const {
+    return material ? material[i] : 0;
+  }
+
+  /*!
+      @brief  Have iterate() keep a list of grains that moved to a different
+              pixel, so displays can update only the pixels that changed
+              rather than redrawing every grain (draw everything once
+              first).  Uses (grains * sizeof(GrainChange)) bytes.
+      @return True on success, false if memory could not be allocated.
+  */
+  bool enableChanges(void);
+
+  /*!
+      @brief  Get number of entries in the change list, see enableChanges().
+      @return Number of grains that moved to a different pixel during the
+              last call to iterate().
+  */
+  grain_count_t getChangeCount(void) const { return nChanges; }
+
+  /*!
+      @brief  Get the change list, see enableChanges().  Within one frame,
+              a pixel may appear as one grain's old and another's new
+              position, so clear all old positions before drawing new ones.
+      @return Pointer to getChangeCount() GrainChange records, or NULL if
+              enableChanges() hasn't been called.  Contents are valid until
+              the next call to iterate().
+  */
+  const GrainChange *getChanges(void) const { return changes; }
+
+  /*!
+      @brief  Get the size of a snapshot of the simulation state, see
+              saveSnapshot().
+      @return Size in bytes.
+  */
+  size_t getSnapshotSize(void) const;
+
+  /*!
+      @brief  Save the full simulation state (pixel grid, grain positions
+              and velocities, elasticity and scaling, random number
+              generator and advance() timing) into a buffer, so a scene
+              can be paused and resumed later, or a pre-settled scene
+              loaded at startup with restoreSnapshot() or
+              attachSnapshot().  The format is binary, versioned, and
+              specific to the architecture and build options (e.g.
+              PIXELDUST_SOA), which are checked when loading.  Grain
+              materials (see setMaterials()) and sleep state (see
+              enableSleep()) are included, and copied when loading either
+              way, so a settled scene resumes with its grains still
+              asleep.  The grain map and change list aren't saved.
+      @param  buf  Buffer to receive the snapshot.
+      @param  size Buffer size in bytes, at least getSnapshotSize().
+      @return Bytes written, or 0 if buffer too small or begin() hasn't
+              been called.
+  */
+  size_t saveSnapshot(void *buf, size_t size) const;
+
+  /*!
+      @brief  Load simulation state from a snapshot made by
+              saveSnapshot(), copying it into this object.  Dimensions
+              and grain count must match those passed to the constructor.
+              Calls begin() if that hasn't been done yet.  If sleep is
+              enabled, grains asleep in the snapshot stay so (all are
+              awake if it has no sleep state), and any grain map is
+              rebuilt.
+      @param  buf  Snapshot data (may be in memory-mapped flash, but not
+                   AVR PROGMEM).
+      @param  size Size of snapshot data in bytes.
+      @return True on success, false if the snapshot is invalid (this
+              includes any grain off the playfield, on a pixel that
+              isn't set, or faster than terminal velocity), from a
+              different version, build or size of simulation, or memory
+              could not be allocated.
+  */
+  bool restoreSnapshot(const void *buf, size_t size);
+
+  /*!
+      @brief  Use a snapshot made by saveSnapshot() as this object's pixel
+              grid and grain storage, with no copying, e.g. a file mapped
+              into memory with mmap() (MAP_PRIVATE, so the file isn't
+              changed) for an instant warm start.  The buffer must be
+              writable, aligned to at least 8 bytes (as mmap() and
+              malloc() are), stay valid for the life of this object, and
+              is modified by iterate().  Memory previously allocated by
+              begin() for these is freed; begin() isn't needed otherwise.
+              Checks and other details are as for restoreSnapshot().
+              Not available with PIXELDUST_SPARSE (always fails).
+      @param  buf  Snapshot data.
+      @param  size Size of snapshot data in bytes.
+      @return True on success, false on error (as for restoreSnapshot()).
+  */
+  bool attachSnapshot(void *buf, size_t size);
+
+  /*!
+      @brief  Compute a hash of the simulation state (grain positions and
+              velocities, pixel grid and random number generator), for
+              checking that two runs, or two builds, given the same seed
+              and inputs produce the same results frame for frame.  The
+              value is the same regardless of architecture or grain
+              storage layout.  It's a quick check (32-bit FNV-1a), not a
+              cryptographic hash.  Results with several threads differ
+              from single-threaded (see setThreads()).
+      @return Hash value.
+  */
+  uint32_t getHash(void) const;
+
+#ifdef PIXELDUST_THREADS
+  /*!
+      @brief  Set the number of threads used by iterate().  With more than
+              one, the playfield is split into horizontal bands (sized so
+              each holds a similar number of grains) that are updated
+              concurrently, alternating between even and odd bands so no
+              two threads ever touch the same row of the bitmap.  Results
+              differ from single-threaded and can't be reproduced by a
+              serial run: grains are moved even bands first, then odd
+              (each band in index or sorted order), and jitter comes from
+              a separate generator per thread, so which grain wins a
+              contested pixel, and the final positions, change.  Results
+              are repeatable for a given seed and thread count only.
+              Fields less than 4 pixels tall are always single-threaded.
+      @param  n Number of threads, including the one calling iterate()
+                (1 = single-threaded, the default).
+      @return True on success, false if threads or memory could not be
+              allocated (iterate() is then single-threaded).
+  */
+  bool setThreads(uint8_t n);
+
+  /*!
+      @brief  Start a background thread that calls iterate() at a fixed
+              rate, with input from setInput(), and publishes each
+              frame's grain positions through a lock-free triple buffer
+              for getFrame().  Simulation and drawing then overlap on
+              multi-core systems, and drawing never waits on (or tears
+              against) the simulation.  While running, call only
+              setInput(), getFrame() and stopRunner(); anything else
+              (e.g. obstacle changes) must wait for stopRunner().  If
+              the thread falls behind it skips ahead rather than trying
+              to catch up.
+      @param  period Microseconds between frames, e.g. 16667 for 60 Hz.
+      @return True on success, false if memory or the thread could not
+              be allocated or period is 0.
+  */
+  bool startRunner(uint32_t period);
+
+  /*!
+      @brief Stop the background thread started by startRunner(), and
+             wait for its current frame to finish.  Does nothing if not
+             running.
+  */
+  void stopRunner(void);
+
+  /*!
+      @brief Set accelerometer input used by the background runner for
+             its next frame, as would be passed to iterate().  Never
+             blocks.  Can be called from any thread.
+      @param ax Accelerometer X input.
+      @param ay Accelerometer Y input.
+      @param az Accelerometer Z input (optional, default is 0).
+  */
+  void setInput(int16_t ax, int16_t ay, int16_t az = 0);
+
+  /*!
+      @brief  Get the latest complete frame from the background runner.
+              Never blocks.  The frame stays valid and unchanged until the
+              next getFrame() call (or stopRunner()), so only one thread
+              should call this.
+      @return Latest frame, the same one as last call if nothing new has
+              been simulated since, or NULL if the runner isn't running.
+  */
+  const GrainFrame *getFrame(void);
+#endif
+
+#ifdef PIXELDUST_STATS
+  /*!
+      @brief  Start recording statistics for each frame (see
+              PixelDustStats) in a history of recent frames, which can be
+              read with getStats() while the simulation runs.  Any
+              previous history is discarded.  Don't call while another
+              thread may be in getStats().
+      @param  frames Number of frames of history to keep (default 64),
+                     or 0 to stop recording and free the history.
+      @return True on success, false if memory could not be allocated.
+  */
+  bool enableStats(uint16_t frames = 64);
+
+  /*!
+      @brief  Get statistics for a recent frame, see enableStats().
+              Never blocks, and can be called from any thread, e.g. a
+              monitoring thread alongside startRunner().  Reading doesn't
+              slow the simulation; if a frame is overwritten while being
+              read, the read is retried.
+      @param  s   Receives the statistics.
+      @param  age Frames before the latest one recorded (default 0, the
+                  latest), up to the history length minus one.
+      @return True on success, false if statistics aren't enabled or that
+              frame isn't in the history (not recorded yet, or too old).
+  */
+  bool getStats(PixelDustStats *s, uint16_t age = 0) const;
+#endif
+
 private:
+  bool allocGrains(void);
+  void freeGrains(void);
+  size_t snapshotBytes(uint8_t sections) const;
+  bool checkSnapshot(const void *buf, size_t size) const;
+  void loadSnapshot(const void *buf);
+  bool loadRest(const void *buf);
+  bool loadMaterials(const void *buf);
+  int16_t scaleInput(int16_t *ax, int16_t *ay, int16_t az) const;
+  void step(int16_t ax, int16_t ay, int16_t az2);
+  bool allocSort(void);
+  void sortIndices(grain_count_t *a, grain_count_t n, grain_count_t *tmp,
+                   int8_t dx, int8_t dy);
+  void sortGrains(uint8_t q);
+  void accelGrains(grain_count_t first, grain_count_t last, int16_t ax,
+                   int16_t ay, int16_t az2, Adafruit_PixelDust_RNG *r);
+  void accelList(const grain_count_t *list, grain_count_t count, int16_t ax,
+                 int16_t ay, int16_t az2, Adafruit_PixelDust_RNG *r);
+  void accelMaterial(const grain_count_t *list, grain_count_t first,
+                     grain_count_t count, int16_t ax, int16_t ay,
+                     int16_t az2, Adafruit_PixelDust_RNG *r);
+  uint8_t moveGrain(grain_count_t i, GrainChange *c);
+  void iterateActive(int16_t ax, int16_t ay, int16_t az2);
+  void wakeAll(void);
+  void wakeAround(dimension_t x, dimension_t y);
+  void wakeChanged(void);
+  bool supported(dimension_t x, dimension_t y) const;
+  void rowOp(dimension_t y, dimension_t x, dimension_t w, const uint8_t *src,
+             dimension_t sx, pixeldust_op_t op);
+#ifdef PIXELDUST_THREADS
+  void iterateThreaded(int16_t ax, int16_t ay, int16_t az2);
+  void runAll(uint8_t task);
+  void runTask(uint8_t t);
+  static void *workerThread(void *arg);
+  void captureFrame(dimension_t *xy) const;
+  static void *runnerThread(void *arg);
+#endif
+#ifdef PIXELDUST_STATS
+  void recordStats(void);
+#endif
+#ifndef __AVR__
+  uint8_t tileBits(dimension_t x, dimension_t y) const;
+  void countTiles(dimension_t x0, dimension_t y0, dimension_t x1,
+                  dimension_t y1);
+  void addTiles(dimension_t x, dimension_t y, int8_t n);
+  void moveTiles(dimension_t ox, dimension_t oy, dimension_t nx,
+                 dimension_t ny);
+  uint32_t countSet(dimension_t x, dimension_t y, dimension_t w,
+                    dimension_t h) const;
+  uint32_t countIn(uint8_t level, dimension_t nx, dimension_t ny,
+                   dimension_t x0, dimension_t y0, dimension_t x1,
+                   dimension_t y1) const;
+  void findIn(uint8_t level, dimension_t nx, dimension_t ny, dimension_t x,
+              dimension_t y, uint32_t *best, dimension_t *fx,
+              dimension_t *fy) const;
+  bool randomFree(dimension_t *x, dimension_t *y);
+#endif
+#ifdef __AVR__
+  void setBit(dimension_t x, dimension_t y);
+  void clearBit(dimension_t x, dimension_t y);
+#else
+  // Bitmap word with only pixel column x's bit set
+  static bitmap_word_t pixelBit(dimension_t x) {
+    return (bitmap_word_t)1 << (~x & (PIXELDUST_WORD_BITS - 1));
+  }
+#ifdef PIXELDUST_SPARSE
+  // Block pointer, loaded so a block just copied by another worker thread
+  // (see unshareBlock()) is seen complete
+  static bitmap_word_t *loadBlock(bitmap_word_t *const *b) {
+#ifdef PIXELDUST_THREADS
+    return __atomic_load_n(b, __ATOMIC_CONSUME);
+#else
+    return *b;
+#endif
+  }
+  // Directory entry for the block holding pixel (x, y)
+  bitmap_word_t **blockFor(dimension_t x, dimension_t y) const {
+    return &block[(size_t)(y >> PIXELDUST_BLOCK_SHIFT) * blockCols +
+                  (x >> PIXELDUST_BLOCK_SHIFT)];
+  }
+  // Index within its block of the word holding pixel (x, y)
+  static uint16_t blockWord(dimension_t x, dimension_t y) {
+    const dimension_t m = (1 << PIXELDUST_BLOCK_SHIFT) - 1;
+    return (((y & m) << PIXELDUST_BLOCK_SHIFT) | (x & m)) /
+           PIXELDUST_WORD_BITS;
+  }
+  // True if a block is one of the shared ones, not to be written
+  bool sharedBlock(const bitmap_word_t *b) const {
+    return (b == bitmap) || (b == &bitmap[PIXELDUST_BLOCK_WORDS]);
+  }
+  // Bitmap word holding pixel (x, y), for reading
+  const bitmap_word_t *readWord(dimension_t x, dimension_t y) const {
+    return &loadBlock(blockFor(x, y))[blockWord(x, y)];
+  }
+  // Same, for writing: a shared block is copied first, and NULL is
+  // returned if that fails
+  bitmap_word_t *writeWord(dimension_t x, dimension_t y) {
+    bitmap_word_t **b = blockFor(x, y), *w = loadBlock(b);
+    if (sharedBlock(w) && !(w = unshareBlock(b, w)))
+      return NULL;
+    return &w[blockWord(x, y)];
+  }
+  bitmap_word_t *unshareBlock(bitmap_word_t **b, bitmap_word_t *w);
+  void shareBlocks(dimension_t x0, dimension_t y0, dimension_t x1,
+                   dimension_t y1);
+  void freeBlocks(void);
+  // Set/clear pixel in bitmap only (setPixel() also updates grain map)
+  void setBit(dimension_t x, dimension_t y) {
+    bitmap_word_t *w = writeWord(x, y);
+    if (w)
+      *w |= pixelBit(x);
+  }
+  void clearBit(dimension_t x, dimension_t y) {
+    bitmap_word_t *w = writeWord(x, y);
+    if (w)
+      *w &= ~pixelBit(x);
+  }
+#else
+  // Bitmap word holding pixel (x, y), for reading or writing
+  const bitmap_word_t *readWord(dimension_t x, dimension_t y) const {
+    return &row[y][x / PIXELDUST_WORD_BITS];
+  }
+  bitmap_word_t *writeWord(dimension_t x, dimension_t y) {
+    return &row[y][x / PIXELDUST_WORD_BITS];
+  }
+  // Set/clear pixel in bitmap only (setPixel() also updates grain map)
+  void setBit(dimension_t x, dimension_t y) {
+    row[y][x / PIXELDUST_WORD_BITS] |= pixelBit(x);
+  }
+  void clearBit(dimension_t x, dimension_t y) {
+    row[y][x / PIXELDUST_WORD_BITS] &= ~pixelBit(x);
+  }
+#endif
+#endif
   dimension_t width,      // Width in pixels
       height,             // Height in pixels
-      w8;                 // Bitmap scanline bytes ((width + 7) / 8)
+      stride;             // Bitmap words per row
   position_t xMax,        // Max X coordinate in grain space
       yMax;               // Max Y coordinate in grain space
   grain_count_t n_grains; // Number of sand grains
   uint8_t scale,          // Accelerometer input scaling = scale/256
       elasticity,         // Grain elasticity (bounce) = elasticity/256
-      *bitmap;            // 2-bit-per-pixel bitmap (width padded to byte)
+      sortOctant;         // Direction of last sort (0-7), 0xFF = none yet
+  bitmap_word_t *bitmap;  // 1-bit-per-pixel bitmap (width padded to word)
+#ifdef PIXELDUST_SPARSE
+  // With PIXELDUST_SPARSE, bitmap holds the shared empty and full blocks
+  // and then the block directory
+  bitmap_word_t **block;  // Each block's storage, by row then column
+  dimension_t blockCols;  // Blocks per row of the directory
+#elif !defined(__AVR__)
+  bitmap_word_t **row;    // Start of each bitmap row, same alloc as bitmap
+#endif
+#ifndef __AVR__
+  Adafruit_PixelDust_Tiles *tiles; // Occupancy summary, NULL if not in use
+#endif
+  grain_count_t *order;   // Grain indices in sorted order, NULL if no sort
+  grain_count_t *sortBuf; // Indices displaced while sorting (non-AVR)
+#ifdef PIXELDUST_SOA
+  position_t *gx, *gy;    // Grain positions, alloc'd in begin()
+  velocity_t *gvx, *gvy;  // Grain velocities, same
+#else
   Grain *grain;           // One per grain, alloc'd in begin()
+#endif
+  grain_count_t *grainMap; // Grain index at each pixel, NULL if not in use
+  GrainChange *changes;   // Pixel changes in last iterate(), or NULL
+  grain_count_t nChanges; // Number of entries in changes[]
+  uint8_t *rest;          // Per grain: frames at rest, 0xFF = asleep
+  grain_count_t *active,  // Indices of grains not asleep (if rest != NULL)
+      nActive;            // Number of entries in active[]
+  uint8_t sleepFrames;    // Frames at rest before a grain sleeps
+  int16_t sleepAx,        // Acceleration when all grains last woke,
+      sleepAy;            // see iterate()
+  uint8_t sleepDir;       // octant() of sleepAx, sleepAy, 0xFF if none
+  uint8_t *material;      // Per grain: material number, or NULL
+  GrainMaterial *materials; // Material table, see setMaterials()
+  uint8_t nMaterials;     // Number of entries in materials[]
+  GrainChange *merged;    // Change list merge space for advance()
+  grain_count_t *mergeSlot; // Per pixel: index in merged[], or EMPTY
+  uint32_t stepPeriod,    // Microseconds per advance() step
+      stepTime;           // Elapsed time not yet simulated
+  uint8_t maxSteps;       // Max steps per advance() call
   bool sort;              // If true, sort bottom-to-top when iterating
+  bool attached;          // If true, bitmap & grains are in a snapshot
+
+  Adafruit_PixelDust_RNG rng; // Random numbers for randomize() & jitter
+#ifdef PIXELDUST_THREADS
+  Adafruit_PixelDust_Workers *workers; // Thread pool, NULL if not in use
+  Adafruit_PixelDust_Runner *runner;   // Background thread, NULL if none
+#endif
+#ifdef PIXELDUST_STATS
+  Adafruit_PixelDust_Stats *stats; // Stats history, NULL if not in use
+  uint32_t moveCount[16];          // moveGrain() results this frame, by value
+#endif
 };
 
 #endif // _ADAFRUIT_PIXELDUST_H_
@@ -21,7 +21,7 @@
 #define N_GRAINS     20 // Number of grains of sand
 #define WIDTH        15 // Display width in pixels
 #define HEIGHT        7 // Display height in pixels
-#define MAX_FPS      45 // Maximum redraw rate, frames/second
+#define SIM_FPS      45 // Simulation steps per second
 
 // Sand object, last 2 args are accelerometer scaling and grain elasticity
 Adafruit_PixelDust sand(WIDTH, HEIGHT, N_GRAINS, 1, 128);
@@ -31,7 +31,7 @@ Adafruit_PixelDust sand(WIDTH, HEIGHT, N_GRAINS, 1, 128);
 uint8_t pixelBuf[WIDTH * HEIGHT];
 
 Adafruit_LIS3DH accel      = Adafruit_LIS3DH();
-uint32_t        prevTime   = 0;      // Used for frames-per-second throttle
+uint32_t        prevTime   = 0;      // Time of last simulation update
 uint8_t         backbuffer = 0;      // Index for double-buffered animation
 
 const uint8_t PROGMEM remap[] = {    // In order to redraw the screen super
@@ -83,7 +83,8 @@ void err(int x) {
 void setup(void) {
   uint8_t i, j, bytes;
 
-  if(!sand.begin())            err(1000); // Slow blink = malloc error
+  if(!sand.begin() ||
+     !sand.enableChanges())    err(1000); // Slow blink = malloc error
   if(!accel.begin(ACCEL_ADDR)) err(250);  // Fast blink = I2C error
 
   accel.setRange(LIS3DH_RANGE_4_G); // Select accelerometer +/- 4G range
@@ -116,6 +117,17 @@ void setup(void) {
   }
 
   sand.randomize(); // Initialize random sand positions
+  sand.setStep(1000000L / SIM_FPS); // Simulation time step, microseconds
+
+  // Draw initial grain positions in pixelBuf[].  After this, only grains
+  // that move are redrawn (see loop()).
+  dimension_t x, y;
+  for(i=0; i<N_GRAINS; i++) {
+    sand.getPosition(i, &x, &y);
+    pixelBuf[y * WIDTH + x] = 80;
+  }
+
+  prevTime = micros();
 }
 
 // MAIN LOOP - RUNS ONCE PER FRAME OF ANIMATION ----------------------------
@@ -124,41 +136,29 @@ void setup(void) {
 const uint8_t PROGMEM color[] = { 0, 80, 5, 5 };
 
 void loop() {
-  // Limit the animation frame rate to MAX_FPS.  Because the subsequent sand
-  // calculations are non-deterministic (don't always take the same amount
-  // of time, depending on their current states), this helps ensure that
-  // things like gravity appear constant in the simulation.
-  uint32_t t;
-  while(((t = micros()) - prevTime) < (1000000L / MAX_FPS));
-  prevTime = t;
-
-  // Display frame rendered on prior pass.  It's done immediately after the
-  // FPS sync (rather than after rendering) for consistent animation timing.
-  pageSelect(0x0B);       // Function registers
-  writeRegister(0x01);    // Picture Display reg
-  Wire.write(backbuffer); // Page # to display
-  Wire.endTransmission();
-  backbuffer = 1 - backbuffer; // Swap front/back buffer index
-
-  // Erase old grain positions in pixelBuf[]
-  uint8_t     i;
-  dimension_t x, y;
-  for(i=0; i<N_GRAINS; i++) {
-    sand.getPosition(i, &x, &y);
-    pixelBuf[y * WIDTH + x] = 0;
-  }
-
+  // Nothing to do until a simulation step is due; don't tie up I2C
+  // reading the accelerometer any more often than that.
+  uint32_t t = micros();
+  if((t - prevTime) < (1000000L / SIM_FPS)) return;
   // Read accelerometer...
   accel.read();
-  // Run one frame of the simulation
+  // Run the simulation for however much time has passed since the last
+  // pass, in fixed steps (see setup()), so gravity appears constant no
+  // matter how long the sand calculations and display updates take.
   // X & Y axes are flipped around here to match physical mounting
-  sand.iterate(-accel.y, accel.x, accel.z);
+  uint8_t  steps = sand.advance(t - prevTime, -accel.y, accel.x, accel.z);
+  prevTime = t;
+  if(!steps) return; // Nothing moved yet, no need to redraw
 
-  // Draw new grain positions in pixelBuf[]
-  for(i=0; i<N_GRAINS; i++) {
-    sand.getPosition(i, &x, &y);
-    pixelBuf[y * WIDTH + x] = 80;
-  }
+  backbuffer = 1 - backbuffer; // Swap front/back buffer index
+
+  // Update pixelBuf[] for just the grains that moved: erase all old
+  // positions first, then draw new ones (a pixel vacated by one grain
+  // may have been taken by another).
+  const GrainChange *c = sand.getChanges();
+  uint8_t            i, n = sand.getChangeCount();
+  for(i=0; i<n; i++) pixelBuf[c[i].oldY * WIDTH + c[i].oldX] = 0;
+  for(i=0; i<n; i++) pixelBuf[c[i].newY * WIDTH + c[i].newX] = 80;
 
   // Update pixel data in LED driver
   uint8_t bytes, *ptr = (uint8_t *)remap;
@@ -169,5 +169,11 @@ void loop() {
     if(++bytes >= 32) bytes = Wire.endTransmission();
   }
   if(bytes) Wire.endTransmission();
+
+  // Display the newly-rendered frame
+  pageSelect(0x0B);       // Function registers
+  writeRegister(0x01);    // Picture Display reg
+  Wire.write(backbuffer); // Page # to display
+  Wire.endTransmission();
 }
 
@@ -0,0 +1,171 @@
+/*!
+ * @file accel.cpp
+ *
+ * Background accelerometer sampling for the Raspberry Pi examples, see
+ * accel.h.
+ *
+ */
+
+#ifndef ARDUINO // Arduino IDE sometimes aggressively builds subfolders
+
+#include "accel.h"
+#include <time.h>
+#include <unistd.h>
+
+// LIS3DHSource -----------------------------------------------------------
+
+LIS3DHSource::LIS3DHSource(int8_t sx, int8_t sy, int8_t sz) {
+  sign[0] = sx;
+  sign[1] = sy;
+  sign[2] = sz;
+}
+
+int LIS3DHSource::begin(uint8_t addr) { return lis3dh.begin(addr, true); }
+
+int LIS3DHSource::read(int16_t (*xyz)[3], int max) {
+  int n = lis3dh.accelReadFIFO(xyz, max);
+  for (int i = 0; i < n; i++) {
+    for (int a = 0; a < 3; a++) {
+      int v = xyz[i][a] * sign[a]; // Negating -32768 won't fit, saturate
+      xyz[i][a] = (v > 32767) ? 32767 : v;
+    }
+  }
+  return n;
+}
+
+// TraceSource ------------------------------------------------------------
+
+TraceSource::TraceSource(void) : name(NULL), frame(0) {
+  data.frames = NULL;
+  data.nFrames = 0;
+}
+
+TraceSource::~TraceSource(void) { traceFree(&data); }
+
+bool TraceSource::begin(const char *n) {
+  int x, y, z;
+  traceFree(&data);
+  name = n;
+  frame = 0;
+  return traceSynthetic(n, 0, &x, &y, &z) || traceLoad(&data, n);
+}
+
+int TraceSource::read(int16_t (*xyz)[3], int max) {
+  int x, y, z;
+  if (max < 1)
+    return 0;
+  if (data.frames) {
+    for (int a = 0; a < 3; a++)
+      xyz[0][a] = data.frames[frame % data.nFrames][a];
+  } else {
+    traceSynthetic(name, frame, &x, &y, &z);
+    xyz[0][0] = x;
+    xyz[0][1] = y;
+    xyz[0][2] = z;
+  }
+  frame++;
+  return 1;
+}
+
+// AccelSampler -----------------------------------------------------------
+
+// Largest burst read per poll (a full LIS3DH FIFO)
+#define MAX_BURST LIS3DH_FIFO_SIZE
+
+AccelSampler::AccelSampler(void)
+    : src(NULL), period(5000), filter(0), count(0), errors(0), quit(false),
+      started(false), latest(0) {
+  avg[0] = avg[1] = avg[2] = 0;
+}
+
+AccelSampler::~AccelSampler(void) { stop(); }
+
+bool AccelSampler::begin(AccelSource *s, uint32_t p, uint8_t f) {
+  stop();
+  src = s;
+  period = p;
+  filter = 0; // First burst is taken as-is
+  count = 0;
+  errors = 0;
+  latest = 0;
+  for (int tries = 0; !count && (tries < 20); tries++) {
+    if (tries)
+      usleep(period); // Source may not have a sample ready yet
+    poll();
+  }
+  filter = f;
+  if (!count) {
+    src = NULL;
+    return false;
+  }
+  quit = false;
+  if (pthread_create(&tid, NULL, thread, this)) {
+    src = NULL;
+    return false;
+  }
+  started = true;
+  return true;
+}
+
+void AccelSampler::stop(void) {
+  if (started) {
+    __atomic_store_n(&quit, true, __ATOMIC_RELAXED);
+    pthread_join(tid, NULL);
+    started = false;
+  }
+  src = NULL;
+}
+
+// Read one burst from the source, average and filter it, and publish
+void AccelSampler::poll(void) {
+  int16_t buf[MAX_BURST][3];
+  int n = src->read(buf, MAX_BURST), a, i;
+  if (n < 0) {
+    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  if (!n)
+    return; // Nothing new, keep last value
+  uint64_t packed = ++count;
+  for (a = 0; a < 3; a++) {
+    int32_t sum = 0;
+    for (i = 0; i < n; i++)
+      sum += buf[i][a];
+    sum = sum * 256 / n; // Burst average, * 256 for filter precision
+    avg[a] = sum + (int32_t)((int64_t)(avg[a] - sum) * filter / 256);
+    // X/Y/Z in the upper 48 bits, count in the low 16
+    packed |= (uint64_t)(uint16_t)(int16_t)(avg[a] / 256) << (16 * (3 - a));
+  }
+  // One 64-bit store, so get() never sees a mix of old and new axes
+  __atomic_store_n(&latest, packed, __ATOMIC_RELEASE);
+}
+
+void *AccelSampler::thread(void *arg) {
+  AccelSampler *s = (AccelSampler *)arg;
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (!__atomic_load_n(&s->quit, __ATOMIC_RELAXED)) {
+    next.tv_nsec += (long)s->period * 1000;
+    while (next.tv_nsec >= 1000000000L) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000L;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    s->poll();
+  }
+  return NULL;
+}
+
+uint16_t AccelSampler::get(int *x, int *y, int *z) const {
+  uint64_t packed = __atomic_load_n(&latest, __ATOMIC_ACQUIRE);
+  *x = (int16_t)(packed >> 48);
+  *y = (int16_t)(packed >> 32);
+  *z = (int16_t)(packed >> 16);
+  return (uint16_t)packed;
+}
+
+uint32_t AccelSampler::getErrors(void) const {
+  return __atomic_load_n(&errors, __ATOMIC_RELAXED);
+}
+
+#endif // !ARDUINO
@@ -0,0 +1,149 @@
+/*!
+ * @file accel.h
+ *
+ * Header file to accompany accel.cpp -- accelerometer input for the
+ * Raspberry Pi examples, sampled on a background thread so I2C latency
+ * stays out of the frame loop.
+ *
+ * An AccelSource delivers bursts of X/Y/Z samples: LIS3DHSource reads
+ * the LIS3DH FIFO, TraceSource plays back a recorded or synthetic trace
+ * (see trace.h) for use without hardware.  An AccelSampler polls a
+ * source from its own thread, averages each burst, optionally smooths
+ * the result, and publishes the latest value for get() without locking.
+ * All values are as passed to Adafruit_PixelDust::iterate().
+ *
+ */
+
+#ifndef _ACCEL_H_
+#define _ACCEL_H_
+
+#include "lis3dh.h"
+#include "trace.h"
+#include <pthread.h>
+#include <stdint.h>
+
+/*!
+    @brief Abstract source of accelerometer samples.
+*/
+class AccelSource {
+public:
+  virtual ~AccelSource(void) {}
+  /*!
+      @brief  Read whatever samples are available since the last call,
+              oldest first.  Called from the sampler thread only.
+      @param  xyz Array to receive X/Y/Z samples.
+      @param  max Size of xyz array.
+      @return Number of samples read (0 if none are ready yet), or -1
+              on error.
+  */
+  virtual int read(int16_t (*xyz)[3], int max) = 0;
+};
+
+/*!
+    @brief LIS3DH accelerometer, read through its FIFO.
+*/
+class LIS3DHSource : public AccelSource {
+public:
+  /*!
+      @brief Constructor.  The axis signs depend on how the accelerometer
+             is mounted relative to the LED matrix; the defaults match
+             the demos.
+      @param sx Sign applied to X readings (1 or -1).
+      @param sy Sign applied to Y readings.
+      @param sz Sign applied to Z readings.
+  */
+  LIS3DHSource(int8_t sx = -1, int8_t sy = -1, int8_t sz = 1);
+  /*!
+      @brief  Start I2C communication and enable the FIFO.
+      @param  addr I2C address of device.
+      @return LIS3DH_OK on success, else one of the LIS3DH_ERR_* values.
+  */
+  int begin(uint8_t addr = LIS3DH_DEFAULT_ADDRESS);
+  int read(int16_t (*xyz)[3], int max);
+
+private:
+  Adafruit_LIS3DH lis3dh;
+  int8_t sign[3]; // Per-axis sign, see constructor
+};
+
+/*!
+    @brief Recorded or synthetic trace, one frame per read() call.
+*/
+class TraceSource : public AccelSource {
+public:
+  TraceSource(void);
+  ~TraceSource(void);
+  /*!
+      @brief  Select a trace to play, looping.
+      @param  name Synthetic trace name (see traceSynthetic()) or trace
+                   file name (see traceLoad()).
+      @return True on success, false if the trace can't be loaded.
+  */
+  bool begin(const char *name);
+  int read(int16_t (*xyz)[3], int max);
+
+private:
+  const char *name;   // Trace name, for synthetic traces
+  trace_data_t data;  // data.frames is NULL for synthetic traces
+  int frame;          // Next frame to play
+};
+
+/*!
+    @brief Background thread polling an AccelSource.
+*/
+class AccelSampler {
+public:
+  AccelSampler(void);
+  /*!
+      @brief Destructor -- stops the sampler thread, if running.
+  */
+  ~AccelSampler(void);
+  /*!
+      @brief  Start sampling.  The first burst is read before returning
+              (waiting a few periods if need be), so get() has a value
+              right away.
+      @param  src    Source to poll; must outlive the sampler (or stop()).
+      @param  period Microseconds between polls (default 5000; the LIS3DH
+                     fills its FIFO in 80 ms at 400 Hz).
+      @param  filter Smoothing, 0-255: each new burst average moves the
+                     published value 1-filter/256 of the way toward it.
+                     0 (the default) is no smoothing.
+      @return True on success, false if no first reading arrives or the
+              thread can't be started.
+  */
+  bool begin(AccelSource *src, uint32_t period = 5000, uint8_t filter = 0);
+  /*!
+      @brief Stop the sampler thread.
+  */
+  void stop(void);
+  /*!
+      @brief  Get the latest (filtered) acceleration.  Never blocks.
+      @param  x Receives X acceleration.
+      @param  y Receives Y acceleration.
+      @param  z Receives Z acceleration.
+      @return Count of bursts published so far (mod 65536), compare
+              between calls to tell whether a new value arrived.
+  */
+  uint16_t get(int *x, int *y, int *z) const;
+  /*!
+      @brief  Get the number of source read errors so far.
+      @return Error count.
+  */
+  uint32_t getErrors(void) const;
+
+private:
+  void poll(void);
+  static void *thread(void *arg);
+  AccelSource *src;   // Source being polled, NULL if not running
+  uint32_t period;    // Microseconds between polls
+  uint8_t filter;     // Smoothing, see begin()
+  int32_t avg[3];     // Filtered X/Y/Z * 256
+  uint16_t count;     // Bursts published
+  uint32_t errors;    // Failed reads
+  bool quit;          // Set to stop the thread
+  bool started;       // True if thread is running
+  uint64_t latest;    // X/Y/Z/count packed in one word, see get()
+  pthread_t tid;      // Sampler thread
+};
+
+#endif // _ACCEL_H_
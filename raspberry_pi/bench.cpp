@@ -0,0 +1,391 @@
+/*!
+ * @file bench.cpp
+ *
+ * Headless benchmark for Adafruit_PixelDust::iterate().  Does NOT need
+ * rpi-rgb-led-matrix or an accelerometer, so it builds and runs on any
+ * Linux box ("make bench").  Sweeps playfield size, fill fraction,
+ * sorting, elasticity, obstacle layout and accelerometer input, printing
+ * one CSV line per configuration with ns/grain/frame and frames/second.
+ * With -H, instead replays each configuration and prints the state hash
+ * (see Adafruit_PixelDust::getHash()) after every frame, to compare one
+ * build or platform against another (e.g. with diff).
+ *
+ * Usage: bench [options]
+ *   -s WxH[,WxH...]   Playfield sizes (default 16x9,64x64,256x256,
+ *                     1024x1024,4096x4096)
+ *   -f F[,F...]       Fill fractions of free pixels, 0.0-1.0
+ *                     (default 0.05,0.25,0.5)
+ *   -o LIST           Obstacle layouts: none, hourglass, logo
+ *                     (default none,hourglass,logo)
+ *   -e E[,E...]       Elasticity values 0-255 (default 128)
+ *   -S LIST           Sort modes: off, on (default off,on)
+ *   -t LIST           Accelerometer traces: down, spin, shake, or the
+ *                     name of a recorded trace file (default down,spin)
+ *   -n FRAMES         Minimum frames timed per configuration (default 30)
+ *   -m MSEC           Minimum milliseconds per configuration (default 250)
+ *   -w FRAMES         Untimed warm-up frames (default 10)
+ *   -r SEED           Random seed (default 1, or from the trace file if
+ *                     it has one)
+ *   -j THREADS        Threads used by iterate() (default 1), see
+ *                     Adafruit_PixelDust::setThreads()
+ *   -z FRAMES         Let grains sleep after this many frames at rest
+ *                     (default 0 = off), see enableSleep().
+ *   -H                Hash mode: no timing or warm-up, print a hash of the
+ *                     simulation state after each frame.  Runs each
+ *                     recorded trace once through, synthetic traces for
+ *                     the -n frame count.
+ *   -P                Profile mode, if built with -DPIXELDUST_STATS (see
+ *                     PIXELDUST_FLAGS in Makefile): also print per-frame
+ *                     averages of phase times (ns) and grain counts from
+ *                     Adafruit_PixelDust::getStats().  Timings include
+ *                     the cost of gathering stats.
+ *
+ * Recorded traces (see trace.h, and record.cpp to make them) are plain
+ * text, one frame per line, three integers (X, Y, Z) as passed to
+ * iterate().  Traces are replayed in a loop if shorter than the run.
+ *
+ */
+
+#ifndef ARDUINO // Arduino IDE sometimes aggressively builds subfolders
+
+#include "Adafruit_PixelDust.h"
+#include "trace.h"
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logo.h" // Obstacle bitmap from demo3
+
+// Upper limit on grains, whatever grain_count_t happens to be
+#define MAX_GRAINS ((grain_count_t)~(grain_count_t)0)
+
+#define MAX_ITEMS 16 ///< Max entries in any one comma-separated option
+
+typedef enum { OBSTACLE_NONE, OBSTACLE_HOURGLASS, OBSTACLE_LOGO } obstacle_t;
+
+static const char *obstacleName[] = {"none", "hourglass", "logo"};
+
+// An accelerometer trace is either one of the synthetic generators or
+// a list of recorded X/Y/Z frames loaded from a file.
+typedef struct {
+  const char *name;
+  trace_data_t data; // data.frames is NULL for synthetic traces
+} trace_t;
+
+// Option lists
+static int nSizes, nFills, nObstacles, nElastic, nSorts, nTraces;
+static int sizeW[MAX_ITEMS], sizeH[MAX_ITEMS], elastic[MAX_ITEMS];
+static double fill[MAX_ITEMS];
+static obstacle_t obstacle[MAX_ITEMS];
+static bool sorts[MAX_ITEMS];
+static trace_t trace[MAX_ITEMS];
+static int minFrames = 30, minMsec = 250, warmup = 10;
+static unsigned int seed = 1;
+static bool seedSet = false, hashMode = false, profileMode = false;
+static int threads = 1, sleepFrames = 0;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Split a comma-separated option in place, return number of items
+static int split(char *str, char **item) {
+  int n = 0;
+  for (char *tok = strtok(str, ","); tok && (n < MAX_ITEMS);
+       tok = strtok(NULL, ","))
+    item[n++] = tok;
+  return n;
+}
+
+// Get accelerometer X/Y/Z for a given frame of a trace
+static void traceFrame(const trace_t *t, int frame, int *x, int *y, int *z) {
+  if (t->data.frames) {
+    int16_t *f = t->data.frames[frame % t->data.nFrames];
+    *x = f[0];
+    *y = f[1];
+    *z = f[2];
+  } else {
+    traceSynthetic(t->name, frame, x, y, z);
+  }
+}
+
+// Mark obstacle pixels, same shapes as the demo2 and demo3 examples
+static void placeObstacles(Adafruit_PixelDust *sand, int width, int height,
+                           obstacle_t o) {
+  if (o == OBSTACLE_HOURGLASS) {
+    for (int y = 0; y < height; y++) {
+      int w =
+          (int)((1.0 - cos((double)y * M_PI * 2.0 / (double)(height - 1))) *
+                    ((double)width / 4.0 - 1.0) +
+                0.5);
+      if (w >= width)
+        w = width - 1;
+      sand->fillSpan(0, y, w + 1);             // Left
+      sand->fillSpan(width - 1 - w, y, w + 1); // Right
+    }
+  } else if (o == OBSTACLE_LOGO) {
+    // Mask is clipped to the playfield if it doesn't fit
+    sand->blit(&logo_mask[0][0], LOGO_WIDTH, LOGO_HEIGHT,
+               (width - LOGO_WIDTH) / 2, (height - LOGO_HEIGHT) / 2);
+  }
+}
+
+// Count free pixels remaining after obstacles are placed
+static long freePixels(Adafruit_PixelDust *sand, int width, int height) {
+  long n = 0;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++)
+      n += !sand->getPixel(x, y);
+  }
+  return n;
+}
+
+// Run one benchmark configuration and print its CSV line
+static void run(int width, int height, double f, obstacle_t o, int e, bool s,
+                const trace_t *t) {
+  Adafruit_PixelDust *sand;
+  Adafruit_PixelDust probe(width, height, 0, 1);
+  long nGrains;
+  int frame, x, y, z;
+  bool capped = false;
+
+  if (!probe.begin()) {
+    fprintf(stderr, "%dx%d: PixelDust init failed\n", width, height);
+    return;
+  }
+  placeObstacles(&probe, width, height, o);
+  nGrains = (long)(freePixels(&probe, width, height) * f);
+  if ((unsigned long)nGrains > (unsigned long)MAX_GRAINS) {
+    nGrains = MAX_GRAINS;
+    capped = true;
+  }
+  if (nGrains < 1)
+    return;
+
+  sand = new Adafruit_PixelDust(width, height, nGrains, 1, e, s);
+  if (!sand->begin()) {
+    fprintf(stderr, "%dx%d: PixelDust init failed\n", width, height);
+    delete sand;
+    return;
+  }
+  if ((threads > 1) && !sand->setThreads(threads))
+    fprintf(stderr, "Can't start %d threads, running single-threaded\n",
+            threads);
+  if (sleepFrames && !sand->enableSleep(sleepFrames))
+    fprintf(stderr, "Can't enable sleeping\n");
+  // Same sand layout and "shake" trace every run, and the same as when
+  // a recorded trace was made, if it says
+  unsigned int s1 = (t->data.hasSeed && !seedSet) ? t->data.seed : seed;
+  sand->seed(s1);
+  srand(s1);
+  placeObstacles(sand, width, height, o);
+  sand->randomize();
+
+  if (hashMode) {
+    int frames = t->data.frames ? t->data.nFrames : minFrames;
+    for (frame = 0; frame < frames; frame++) {
+      traceFrame(t, frame, &x, &y, &z);
+      sand->iterate(x, y, z);
+      printf("%dx%d,%ld%s,%.3f,%s,%d,%s,%s,%d,%08lx\n", width, height,
+             nGrains, capped ? "*" : "", f, obstacleName[o], e,
+             s ? "on" : "off", t->name, frame,
+             (unsigned long)sand->getHash());
+    }
+    fflush(stdout);
+    delete sand;
+    return;
+  }
+
+  for (frame = 0; frame < warmup; frame++) {
+    traceFrame(t, frame, &x, &y, &z);
+    sand->iterate(x, y, z);
+  }
+
+#ifdef PIXELDUST_STATS
+  // Sums of each stat over timed frames
+  double sum[8] = {0};
+  PixelDustStats st;
+  if (profileMode && !sand->enableStats(1))
+    fprintf(stderr, "Can't enable stats\n");
+#endif
+
+  double start = now(), elapsed;
+  int timed = 0;
+  do {
+    traceFrame(t, frame++, &x, &y, &z);
+    sand->iterate(x, y, z);
+#ifdef PIXELDUST_STATS
+    if (profileMode && sand->getStats(&st)) {
+      sum[0] += st.sortTime;
+      sum[1] += st.accelTime;
+      sum[2] += st.moveTime;
+      sum[3] += st.moved;
+      sum[4] += st.blocked;
+      sum[5] += st.skids;
+      sum[6] += st.walls;
+      sum[7] += st.energy;
+    }
+#endif
+    timed++;
+  } while (((elapsed = now() - start) * 1000.0 < minMsec) ||
+           (timed < minFrames));
+
+  printf("%dx%d,%ld%s,%.3f,%s,%d,%s,%s,%d,%.2f,%.1f", width, height,
+         nGrains, capped ? "*" : "", f, obstacleName[o], e, s ? "on" : "off",
+         t->name, timed, elapsed * 1e9 / ((double)timed * (double)nGrains),
+         (double)timed / elapsed);
+#ifdef PIXELDUST_STATS
+  if (profileMode) {
+    for (int i = 0; i < 8; i++)
+      printf(",%.0f", sum[i] / timed);
+  }
+#endif
+  putchar('\n');
+  fflush(stdout);
+
+  delete sand;
+}
+
+int main(int argc, char **argv) {
+  char *item[MAX_ITEMS];
+  int i, opt;
+
+  // Defaults
+  char sizes[] = "16x9,64x64,256x256,1024x1024,4096x4096",
+       fills[] = "0.05,0.25,0.5", obstacles[] = "none,hourglass,logo",
+       elastics[] = "128", sortModes[] = "off,on", traces[] = "down,spin";
+  char *sizeOpt = sizes, *fillOpt = fills, *obstacleOpt = obstacles,
+       *elasticOpt = elastics, *sortOpt = sortModes, *traceOpt = traces;
+
+  while ((opt = getopt(argc, argv, "s:f:o:e:S:t:n:m:w:r:j:z:HP")) != -1) {
+    switch (opt) {
+    case 's':
+      sizeOpt = optarg;
+      break;
+    case 'f':
+      fillOpt = optarg;
+      break;
+    case 'o':
+      obstacleOpt = optarg;
+      break;
+    case 'e':
+      elasticOpt = optarg;
+      break;
+    case 'S':
+      sortOpt = optarg;
+      break;
+    case 't':
+      traceOpt = optarg;
+      break;
+    case 'n':
+      minFrames = atoi(optarg);
+      break;
+    case 'm':
+      minMsec = atoi(optarg);
+      break;
+    case 'w':
+      warmup = atoi(optarg);
+      break;
+    case 'r':
+      seed = strtoul(optarg, NULL, 0);
+      seedSet = true;
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'z':
+      sleepFrames = atoi(optarg);
+      break;
+    case 'H':
+      hashMode = true;
+      break;
+    case 'P':
+#ifdef PIXELDUST_STATS
+      profileMode = true;
+#else
+      fprintf(stderr, "-P needs a build with -DPIXELDUST_STATS\n");
+      return 1;
+#endif
+      break;
+    default:
+      fprintf(stderr, "See comments at top of bench.cpp for options\n");
+      return 1;
+    }
+  }
+
+  nSizes = split(sizeOpt, item);
+  for (i = 0; i < nSizes; i++) {
+    if ((sscanf(item[i], "%dx%d", &sizeW[i], &sizeH[i]) != 2) ||
+        (sizeW[i] < 1) || (sizeH[i] < 1) || (sizeW[i] > 32767) ||
+        (sizeH[i] > 32767)) {
+      fprintf(stderr, "Bad size '%s'\n", item[i]);
+      return 1;
+    }
+  }
+  nFills = split(fillOpt, item);
+  for (i = 0; i < nFills; i++)
+    fill[i] = atof(item[i]);
+  nObstacles = split(obstacleOpt, item);
+  for (i = 0; i < nObstacles; i++) {
+    if (!strcmp(item[i], "none")) {
+      obstacle[i] = OBSTACLE_NONE;
+    } else if (!strcmp(item[i], "hourglass")) {
+      obstacle[i] = OBSTACLE_HOURGLASS;
+    } else if (!strcmp(item[i], "logo")) {
+      obstacle[i] = OBSTACLE_LOGO;
+    } else {
+      fprintf(stderr, "Bad obstacle layout '%s'\n", item[i]);
+      return 1;
+    }
+  }
+  nElastic = split(elasticOpt, item);
+  for (i = 0; i < nElastic; i++)
+    elastic[i] = atoi(item[i]) & 0xFF;
+  nSorts = split(sortOpt, item);
+  for (i = 0; i < nSorts; i++)
+    sorts[i] = !strcmp(item[i], "on");
+  nTraces = split(traceOpt, item);
+  for (i = 0; i < nTraces; i++) {
+    int x, y, z;
+    trace[i].name = item[i];
+    trace[i].data.frames = NULL;
+    trace[i].data.hasSeed = false;
+    if (!traceSynthetic(item[i], 0, &x, &y, &z) &&
+        !traceLoad(&trace[i].data, item[i])) {
+      fprintf(stderr, "Can't load trace '%s'\n", item[i]);
+      return 1;
+    }
+  }
+
+  // Columns are kept stable so results can be diffed between releases.
+  // Grain counts marked '*' were capped at the grain_count_t limit.
+  if (hashMode)
+    puts("size,grains,fill,obstacles,elasticity,sort,trace,frame,hash");
+  else if (profileMode)
+    puts("size,grains,fill,obstacles,elasticity,sort,trace,frames,"
+         "ns_per_grain_frame,fps,sort_ns,accel_ns,move_ns,moved,blocked,"
+         "skids,walls,energy");
+  else
+    puts("size,grains,fill,obstacles,elasticity,sort,trace,frames,"
+         "ns_per_grain_frame,fps");
+  for (int a = 0; a < nSizes; a++) {
+    for (int b = 0; b < nFills; b++) {
+      for (int c = 0; c < nObstacles; c++) {
+        for (int d = 0; d < nElastic; d++) {
+          for (int e = 0; e < nSorts; e++) {
+            for (int f = 0; f < nTraces; f++) {
+              run(sizeW[a], sizeH[a], fill[b], obstacle[c], elastic[d],
+                  sorts[e], &trace[f]);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  return 0;
+}
+
+#endif // !ARDUINO
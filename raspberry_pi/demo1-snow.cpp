@@ -10,14 +10,18 @@
 #ifndef ARDUINO // Arduino IDE sometimes aggressively builds subfolders
 
 #include "Adafruit_PixelDust.h"
+#include "accel.h"
 #include "led-matrix-c.h"
-#include "lis3dh.h"
 #include <signal.h>
 
 #define N_FLAKES 900 ///< Number of snowflakes on 64x64 matrix
+#define SIM_FPS 60 ///< Simulation rate, independent of matrix refresh
 
 struct RGBLedMatrix *matrix = NULL;
-Adafruit_LIS3DH lis3dh;
+// Axis flip (constructor arguments) depends how the
+// accelerometer is mounted relative to the LED matrix.
+LIS3DHSource lis3dh;
+AccelSampler accel; // Reads LIS3DH in the background
 volatile bool running = true;
 int nFlakes = N_FLAKES; // Runtime flake count (adapts to res)
 
@@ -74,24 +78,31 @@ int main(int argc, char **argv) {
     return 2;
   }
 
-  if (lis3dh.begin()) {
+  if (lis3dh.begin() || !accel.begin(&lis3dh)) {
     puts("LIS3DH init failed");
     return 3;
   }
 
   snow->randomize(); // Initialize random snowflake positions
 
+  // Simulation runs on its own thread from here on, overlapping with
+  // drawing and matrix refresh
+  if (!snow->startRunner(1000000 / SIM_FPS)) {
+    puts("PixelDust thread failed");
+    return 4;
+  }
+
   while (running) {
-    lis3dh.accelRead(&xx, &yy, &zz);
-    // Run one frame of the simulation.  Axis flip here
-    // depends how the accelerometer is mounted relative
-    // to the LED matrix.
-    snow->iterate(-xx, -yy, zz);
+    accel.get(&xx, &yy, &zz); // Latest reading, doesn't wait on I2C
+    snow->setInput(xx, yy, zz);
+    // Latest complete frame, doesn't wait on the simulation
+    const GrainFrame *frame = snow->getFrame();
 
     // Erase canvas and draw new snowflake positions
     led_canvas_clear(canvas);
     for (i = 0; i < nFlakes; i++) {
-      snow->getPosition(i, &x, &y);
+      x = frame->xy[i * 2];
+      y = frame->xy[i * 2 + 1];
       led_canvas_set_pixel(canvas, x, y, 255, 255, 255);
     }
 
@@ -100,6 +111,7 @@ int main(int argc, char **argv) {
     canvas = led_matrix_swap_on_vsync(matrix, canvas);
   }
 
+  snow->stopRunner();
   return 0;
 }
 
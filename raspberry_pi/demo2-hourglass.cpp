@@ -11,14 +11,18 @@
 #ifndef ARDUINO // Arduino IDE sometimes aggressively builds subfolders
 
 #include "Adafruit_PixelDust.h"
+#include "accel.h"
 #include "led-matrix-c.h"
-#include "lis3dh.h"
 #include <signal.h>
 
 #define N_GRAINS 800 ///< Number of sand grains on 64x64 matrix
+#define SIM_FPS 60 ///< Simulation rate, independent of matrix refresh
 
 struct RGBLedMatrix *matrix;
-Adafruit_LIS3DH lis3dh;
+// Axis flip (constructor arguments) depends how the
+// accelerometer is mounted relative to the LED matrix.
+LIS3DHSource lis3dh;
+AccelSampler accel; // Reads LIS3DH in the background
 volatile bool running = true;
 int nGrains = N_GRAINS; // Runtime grain count (adapts to res)
 
@@ -69,7 +73,7 @@ int main(int argc, char **argv) {
   if (height < 64)
     nGrains /= 2; // for smaller matrices
 
-  if (lis3dh.begin()) {
+  if (lis3dh.begin() || !accel.begin(&lis3dh)) {
     puts("LIS3DH init failed");
     return 2;
   }
@@ -87,22 +91,25 @@ int main(int argc, char **argv) {
     w = (int)((1.0 - cos((double)i * M_PI * 2.0 / (double)(height - 1))) *
                   ((double)width / 4.0 - 1.0) +
               0.5);
-    for (x = 0; x <= w; x++) {
-      sand->setPixel(x, i);             // Left
-      sand->setPixel(width - 1 - x, i); // Right
-    }
+    sand->fillSpan(0, i, w + 1);             // Left
+    sand->fillSpan(width - 1 - w, i, w + 1); // Right
   }
 
   sand->randomize(); // Initialize random sand positions
 
+  // Simulation runs on its own thread from here on, overlapping with
+  // drawing and matrix refresh
+  if (!sand->startRunner(1000000 / SIM_FPS)) {
+    puts("PixelDust thread failed");
+    return 4;
+  }
+
   while (running) {
     // Read accelerometer...
-    lis3dh.accelRead(&xx, &yy, &zz);
-
-    // Run one frame of the simulation.  Axis flip here
-    // depends how the accelerometer is mounted relative
-    // to the LED matrix.
-    sand->iterate(-xx, -yy, zz);
+    accel.get(&xx, &yy, &zz); // Latest reading, doesn't wait on I2C
+    sand->setInput(xx, yy, zz);
+    // Latest complete frame, doesn't wait on the simulation
+    const GrainFrame *frame = sand->getFrame();
 
     // Canvas is cleared and both the hourglass and sand
     // grains are re-drawn every frame.  It's easier than
@@ -119,7 +126,8 @@ int main(int argc, char **argv) {
       }
     }
     for (i = 0; i < nGrains; i++) { // Sand...
-      sand->getPosition(i, &x, &y);
+      x = frame->xy[i * 2];
+      y = frame->xy[i * 2 + 1];
       led_canvas_set_pixel(canvas, x, y, 200, 200, 100);
     }
 
@@ -128,6 +136,7 @@ int main(int argc, char **argv) {
     canvas = led_matrix_swap_on_vsync(matrix, canvas);
   }
 
+  sand->stopRunner();
   return 0;
 }
 
@@ -15,16 +15,20 @@
 #ifndef ARDUINO // Arduino IDE sometimes aggressively builds subfolders
 
 #include "Adafruit_PixelDust.h"
+#include "accel.h"
 #include "led-matrix-c.h"
-#include "lis3dh.h"
 #include <signal.h>
 
 #include "logo.h" // This contains the obstacle bitmaps
 
 #define N_GRAINS (8 * 8 * 8) ///< Number of grains of sand on 64x64 matrix
+#define SIM_FPS 60 ///< Simulation rate, independent of matrix refresh
 
 struct RGBLedMatrix *matrix = NULL;
-Adafruit_LIS3DH lis3dh;
+// Axis flip (constructor arguments) depends how the
+// accelerometer is mounted relative to the LED matrix.
+LIS3DHSource lis3dh;
+AccelSampler accel; // Reads LIS3DH in the background
 volatile bool running = true;
 int nGrains = N_GRAINS; // Runtime grain count (adapts to res)
 
@@ -84,16 +88,15 @@ int main(int argc, char **argv) {
   fprintf(stderr, "Size: %dx%d. Hardware gpio mapping: %s\n", width, height,
           options.hardware_mapping);
 
-  if (lis3dh.begin()) {
+  if (lis3dh.begin() || !accel.begin(&lis3dh)) {
     puts("LIS3DH init failed");
     return 2;
   }
 
-  // For this demo, the last argument to the PixelDust constructor
-  // is set 'false' so the grains are not sorted each frame.
-  // This is because the grains have specific colors by index
-  // (sorting would mess that up).
-  sand = new Adafruit_PixelDust(width, height, nGrains, 1, 64, false);
+  // The grains have specific colors by index.  Sorting (last argument
+  // to the PixelDust constructor) processes grains in a sorted order
+  // but doesn't renumber them, so colors stay with their grains.
+  sand = new Adafruit_PixelDust(width, height, nGrains, 1, 64, true);
   if (!sand->begin()) {
     puts("PixelDust init failed");
     return 3;
@@ -102,14 +105,7 @@ int main(int argc, char **argv) {
   // Set up the logo bitmap obstacle in the PixelDust playfield
   int x1 = (width - LOGO_WIDTH) / 2;
   int y1 = (height - LOGO_HEIGHT) / 2;
-  for (y = 0; y < LOGO_HEIGHT; y++) {
-    for (x = 0; x < LOGO_WIDTH; x++) {
-      uint8_t c = logo_mask[y][x / 8];
-      if (c & (0x80 >> (x & 7))) {
-        sand->setPixel(x1 + x, y1 + y);
-      }
-    }
-  }
+  sand->blit(&logo_mask[0][0], LOGO_WIDTH, LOGO_HEIGHT, x1, y1);
 
   // Set up initial sand coordinates, in 8x8 blocks
   int n = 0;
@@ -123,14 +119,19 @@ int main(int argc, char **argv) {
     }
   }
 
+  // Simulation runs on its own thread from here on, overlapping with
+  // drawing and matrix refresh
+  if (!sand->startRunner(1000000 / SIM_FPS)) {
+    puts("PixelDust thread failed");
+    return 4;
+  }
+
   while (running) {
     // Read accelerometer...
-    lis3dh.accelRead(&xx, &yy, &zz);
-
-    // Run one frame of the simulation.  Axis flip here
-    // depends how the accelerometer is mounted relative
-    // to the LED matrix.
-    sand->iterate(-xx, -yy, zz);
+    accel.get(&xx, &yy, &zz); // Latest reading, doesn't wait on I2C
+    sand->setInput(xx, yy, zz);
+    // Latest complete frame, doesn't wait on the simulation
+    const GrainFrame *frame = sand->getFrame();
 
     // led_canvas_fill() doesn't appear to work properly
     // with the --led-rgb-sequence option...so clear the
@@ -152,7 +153,8 @@ int main(int argc, char **argv) {
 
     // Draw new sand atop canvas
     for (i = 0; i < nGrains; i++) {
-      sand->getPosition(i, &x, &y);
+      x = frame->xy[i * 2];
+      y = frame->xy[i * 2 + 1];
       int n = i / 64; // Color index
       led_canvas_set_pixel(canvas, x, y, colors[n][0], colors[n][1],
                            colors[n][2]);
@@ -163,6 +165,7 @@ int main(int argc, char **argv) {
     canvas = led_matrix_swap_on_vsync(matrix, canvas);
   }
 
+  sand->stopRunner();
   return 0;
 }
 
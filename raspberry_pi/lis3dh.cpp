@@ -13,18 +13,27 @@
 #define LIS3DH_REG_TEMPCFG 0x1F
 #define LIS3DH_REG_CTRL1 0x20
 #define LIS3DH_REG_CTRL4 0x23
+#define LIS3DH_REG_CTRL5 0x24
 #define LIS3DH_REG_OUT_X_L 0x28
+#define LIS3DH_REG_FIFOCTRL 0x2E
+#define LIS3DH_REG_FIFOSRC 0x2F
 
-Adafruit_LIS3DH::Adafruit_LIS3DH(void) : i2c_fd(-1) {}
+// Most I2C_RDWR messages the kernel accepts in one ioctl()
+#ifndef I2C_RDWR_IOCTL_MAX_MSGS
+#define I2C_RDWR_IOCTL_MAX_MSGS 42
+#endif
+
+Adafruit_LIS3DH::Adafruit_LIS3DH(void) : i2c_fd(-1), i2c_addr(0) {}
 
 Adafruit_LIS3DH::~Adafruit_LIS3DH(void) { end(); }
 
-int Adafruit_LIS3DH::begin(uint8_t addr) {
+int Adafruit_LIS3DH::begin(uint8_t addr, bool fifo) {
   if ((i2c_fd = open("/dev/i2c-1", O_RDWR)) < 0)
     return LIS3DH_ERR_I2C_OPEN;
 
   if (ioctl(i2c_fd, I2C_SLAVE, addr) < 0)
     return LIS3DH_ERR_I2C_SLAVE;
+  i2c_addr = addr;
 
   writeRegister8(LIS3DH_REG_CTRL1,
                  0x07 | // Enable all axes, normal mode
@@ -41,6 +50,14 @@ int Adafruit_LIS3DH::begin(uint8_t addr) {
   r |= LIS3DH_RANGE_4_G << 4;
   writeRegister8(LIS3DH_REG_CTRL4, r);
 
+  if (fifo) {
+    writeRegister8(LIS3DH_REG_CTRL5, 0x40);    // FIFO enable
+    writeRegister8(LIS3DH_REG_FIFOCTRL, 0x80); // Stream mode
+  } else {
+    writeRegister8(LIS3DH_REG_FIFOCTRL, 0x00); // Bypass mode
+    writeRegister8(LIS3DH_REG_CTRL5, 0x00);
+  }
+
   return LIS3DH_OK;
 }
 
@@ -68,6 +85,66 @@ const void Adafruit_LIS3DH::accelRead(int *x, int *y, int *z) {
   *z = (buf[4] | ((int)buf[5] << 8));
 }
 
+// Run a combined I2C transaction (repeated start between messages, no
+// bus release), returns true on success
+bool Adafruit_LIS3DH::transfer(struct i2c_msg *msgs, int n) {
+  struct i2c_rdwr_ioctl_data data;
+  data.msgs = msgs;
+  data.nmsgs = n;
+  return ioctl(i2c_fd, I2C_RDWR, &data) == n;
+}
+
+int Adafruit_LIS3DH::accelReadFIFO(int16_t (*xyz)[3], int max) {
+  // Each sample is a register address write and a 6-byte read, as a
+  // pair of messages.  Batching pairs into one ioctl() avoids a system
+  // call and bus turnaround per sample vs. accelRead().
+  static uint8_t regOut = LIS3DH_REG_OUT_X_L | 0x80, // 0x80 autoincrement
+      regSrc = LIS3DH_REG_FIFOSRC;
+  struct i2c_msg msg[I2C_RDWR_IOCTL_MAX_MSGS];
+  uint8_t buf[LIS3DH_FIFO_SIZE][6], src;
+  int i, n, done;
+
+  msg[0].addr = i2c_addr; // FIFO status first, for number of samples
+  msg[0].flags = 0;
+  msg[0].len = 1;
+  msg[0].buf = &regSrc;
+  msg[1].addr = i2c_addr;
+  msg[1].flags = I2C_M_RD;
+  msg[1].len = 1;
+  msg[1].buf = &src;
+  if (!transfer(msg, 2))
+    return -1;
+  n = (src & 0x40) ? LIS3DH_FIFO_SIZE : (src & 0x1F); // Overrun = full
+  if (n > max)
+    n = max;
+
+  for (done = 0; done < n;) {
+    int batch = n - done;
+    if (batch > I2C_RDWR_IOCTL_MAX_MSGS / 2)
+      batch = I2C_RDWR_IOCTL_MAX_MSGS / 2;
+    for (i = 0; i < batch; i++) {
+      msg[i * 2].addr = i2c_addr;
+      msg[i * 2].flags = 0;
+      msg[i * 2].len = 1;
+      msg[i * 2].buf = &regOut;
+      msg[i * 2 + 1].addr = i2c_addr;
+      msg[i * 2 + 1].flags = I2C_M_RD;
+      msg[i * 2 + 1].len = 6;
+      msg[i * 2 + 1].buf = buf[done + i];
+    }
+    if (!transfer(msg, batch * 2))
+      return -1;
+    done += batch;
+  }
+
+  for (i = 0; i < n; i++) {
+    xyz[i][0] = buf[i][0] | ((int)buf[i][1] << 8);
+    xyz[i][1] = buf[i][2] | ((int)buf[i][3] << 8);
+    xyz[i][2] = buf[i][4] | ((int)buf[i][5] << 8);
+  }
+  return n;
+}
+
 void Adafruit_LIS3DH::end(void) {
   if (i2c_fd >= 0) {
     close(i2c_fd);
@@ -11,6 +11,7 @@
 
 #include <fcntl.h>
 #include <linux/i2c-dev.h>
+#include <linux/i2c.h>
 #include <stdint.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
@@ -22,6 +23,8 @@
 #define LIS3DH_ERR_I2C_OPEN 1  ///< I2C open() failed
 #define LIS3DH_ERR_I2C_SLAVE 2 ///< I2C ioctl() slave select failed
 
+#define LIS3DH_FIFO_SIZE 32 ///< Samples held by the LIS3DH FIFO
+
 // These enums don't see much use (yet?).  They're carried over
 // from the Arduino library source in case this library is expanded
 // with more equivalent functions.
@@ -87,9 +90,13 @@ public:
       @brief  Initiates I2C communication with the LIS3DH accelerometer.
       @param  I2C address of device (optional -- uses default 0x18 if
               unspecified).
+      @param  fifo If true, the FIFO is enabled in stream mode, so
+              samples taken at the 400 Hz data rate queue up for
+              accelReadFIFO().  accelRead() then returns the oldest
+              queued sample, so use one or the other.
       @return LIS3DH_OK on success, else one of the LIS3DH_ERR_* values.
   */
-  int begin(uint8_t addr = LIS3DH_DEFAULT_ADDRESS);
+  int begin(uint8_t addr = LIS3DH_DEFAULT_ADDRESS, bool fifo = false);
   /*!
       @brief 'Raw' reading of accelerometer X/Y/Z.
       @param Pointer to integer to receive X acceleration value.
@@ -97,6 +104,17 @@ public:
       @param Pointer to integer to receive Z acceleration value.
   */
   const void accelRead(int *x, int *y, int *z);
+  /*!
+      @brief  Read all samples queued in the FIFO (see begin()), oldest
+              first, in as few I2C transactions as the bus driver
+              allows.
+      @param  xyz Array to receive 'raw' X/Y/Z readings.
+      @param  max Size of xyz array, up to LIS3DH_FIFO_SIZE samples are
+              read.
+      @return Number of samples read (0 if none were queued), or -1 on
+              I2C error.
+  */
+  int accelReadFIFO(int16_t (*xyz)[3], int max);
   /*!
       @brief Closes I2C communication with accelerometer.
   */
@@ -106,6 +124,8 @@ private:
   int i2c_fd; // I2C file descriptor
   const void writeRegister8(uint8_t reg, uint8_t value);
   const uint8_t readRegister8(uint8_t reg);
+  bool transfer(struct i2c_msg *msgs, int n);
+  uint8_t i2c_addr; // I2C address, for I2C_RDWR transactions
 };
 
 #endif // _LIS3DH_H_
@@ -0,0 +1,116 @@
+/*!
+ * @file record.cpp
+ *
+ * Records LIS3DH accelerometer input to a trace file, for replaying
+ * headless with bench (e.g. "bench -t FILE", or "bench -H -t FILE" to
+ * check results frame by frame).  Values are recorded as the demos pass
+ * them to iterate(), so hold or mount the accelerometer the same way.
+ * Needs the LIS3DH but not rpi-rgb-led-matrix.
+ * I2C MUST BE ENABLED using raspi-config!
+ * With -t, input comes from another trace instead (no hardware needed),
+ * through the same background sampler the demos use.
+ *
+ * Usage: record [options] FILE
+ *   -f FPS      Frames per second (default 60)
+ *   -s SECONDS  Stop after this long (default 0 = until Ctrl-C)
+ *   -r SEED     Random seed noted in the trace (default 1)
+ *   -t TRACE    Sample a synthetic trace (down, spin, shake) or trace
+ *               file rather than the LIS3DH, played at FPS (frames may
+ *               repeat or skip, as the sampler runs asynchronously)
+ *   -a FILTER   Accelerometer smoothing 0-255 (default 0 = none), see
+ *               AccelSampler::begin()
+ *
+ */
+
+#ifndef ARDUINO // Arduino IDE sometimes aggressively builds subfolders
+
+#include "accel.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+
+LIS3DHSource lis3dh; // Axis flip as in the demos
+TraceSource traceSource;
+AccelSampler accel;
+volatile bool running = true;
+
+void irqHandler(int dummy) { running = false; }
+
+int main(int argc, char **argv) {
+  int fps = 60, seconds = 0, filter = 0, opt, xx, yy, zz;
+  uint32_t seed = 1;
+  const char *traceName = NULL;
+  FILE *fp;
+
+  while ((opt = getopt(argc, argv, "f:s:r:t:a:")) != -1) {
+    switch (opt) {
+    case 'f':
+      fps = atoi(optarg);
+      break;
+    case 's':
+      seconds = atoi(optarg);
+      break;
+    case 'r':
+      seed = strtoul(optarg, NULL, 0);
+      break;
+    case 't':
+      traceName = optarg;
+      break;
+    case 'a':
+      filter = atoi(optarg) & 0xFF;
+      break;
+    default:
+      fprintf(stderr, "See comments at top of record.cpp for options\n");
+      return 1;
+    }
+  }
+  if ((optind >= argc) || (fps < 1)) {
+    fprintf(stderr, "See comments at top of record.cpp for options\n");
+    return 1;
+  }
+
+  if (traceName) {
+    // One trace frame per recorded frame
+    if (!traceSource.begin(traceName) ||
+        !accel.begin(&traceSource, 1000000L / fps, filter)) {
+      fprintf(stderr, "Can't load trace '%s'\n", traceName);
+      return 2;
+    }
+  } else if (lis3dh.begin() || !accel.begin(&lis3dh, 5000, filter)) {
+    puts("LIS3DH init failed");
+    return 2;
+  }
+  if (!(fp = traceCreate(argv[optind], seed))) {
+    perror(argv[optind]);
+    return 3;
+  }
+  signal(SIGINT, irqHandler);
+  signal(SIGTERM, irqHandler);
+
+  // Sample on a fixed schedule, so the trace plays back at the same rate
+  // as it was recorded if replayed at the same frames per second
+  long frames = 0, limit = (long)seconds * fps;
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (running && (!limit || (frames < limit))) {
+    accel.get(&xx, &yy, &zz);
+    traceWrite(fp, xx, yy, zz);
+    frames++;
+    next.tv_nsec += 1000000000L / fps;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000L;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+
+  accel.stop();
+  fclose(fp);
+  fprintf(stderr, "%ld frames recorded", frames);
+  if (accel.getErrors())
+    fprintf(stderr, ", %lu I2C errors", (unsigned long)accel.getErrors());
+  fputc('\n', stderr);
+  return 0;
+}
+
+#endif // !ARDUINO
@@ -0,0 +1,926 @@
+/*!
+ * @file selftest.cpp
+ *
+ * Self-tests for Adafruit_PixelDust, covering behavior that's easy to
+ * break without anything looking wrong on a matrix.  Needs neither
+ * rpi-rgb-led-matrix nor LIS3DH hardware ("make check").  The library
+ * source is compiled in directly, with the structure-of-arrays layout,
+ * so internal functions can be tested too.  Prints one line per test and
+ * exits with nonzero status if any failed.
+ *
+ */
+
+#ifndef ARDUINO // Arduino IDE sometimes aggressively builds subfolders
+
+#ifndef PIXELDUST_SOA
+#define PIXELDUST_SOA
+#endif
+#include "Adafruit_PixelDust.cpp"
+#include <stddef.h>
+#include <stdio.h>
+
+#ifndef PIXELDUST_FIXED_POINT
+// Terminal velocity clipping is defined exactly, unless using fixed point:
+// each component becomes 256 * c / |v| rounded toward zero (see
+// clipComponent()).  True if q is that for component c of a vector with
+// squared magnitude v2.
+static bool exactClip(int32_t c, int32_t v2, int32_t q) {
+  int64_t a = (c < 0) ? -c : c, limit = a * a * 65536;
+  if ((c < 0) ? (q > 0) : (q < 0))
+    return !q;
+  q = (q < 0) ? -q : q;
+  return ((int64_t)q * q * v2 <= limit) &&
+         ((int64_t)(q + 1) * (q + 1) * v2 > limit);
+}
+#endif
+
+// SIMD velocity pass must match the scalar terminalVelocity() exactly,
+// or simulations diverge from the default layout.  Runs accelBlock() on
+// every velocity in a range a little wider than terminal velocity, then
+// a sparser grid well beyond, at several acceleration values, and
+// compares against the scalar math, which is also checked for exactness.
+static bool testAccelBlock(void) {
+  static const int16_t accel[][2] = {{0, 0}, {3, -7}, {-40, 25}};
+  velocity_t vx[64], vy[64], ex[64], ey[64];
+  int16_t jx[64], jy[64];
+  uint32_t mismatches = 0, inexact = 0;
+
+  for (uint8_t a = 0; a < sizeof accel / sizeof accel[0]; a++) {
+    int16_t ax = accel[a][0], ay = accel[a][1];
+    for (int y = -8000; y <= 8000; y += ((y >= -320) && (y < 320)) ? 1 : 97) {
+      for (int x0 = -8000; x0 <= 8000;
+           x0 += ((x0 >= -320) && (x0 < 320)) ? 61 : 1019) {
+        // 61 velocities per block, so blocks end with leftovers
+        for (uint8_t i = 0; i < 61; i++) {
+          vx[i] = x0 + i;
+          vy[i] = y;
+          jx[i] = (i % 3) - 1;
+          jy[i] = (i % 5) - 2;
+          ex[i] = vx[i] + ax + jx[i];
+          ey[i] = vy[i] + ay + jy[i];
+          terminalVelocity(&ex[i], &ey[i]);
+#ifndef PIXELDUST_FIXED_POINT
+          int16_t cx = vx[i] + ax + jx[i], cy = vy[i] + ay + jy[i];
+          int32_t v2 = (int32_t)cx * cx + (int32_t)cy * cy;
+          if ((v2 > 65536) &&
+              (!exactClip(cx, v2, ex[i]) || !exactClip(cy, v2, ey[i])) &&
+              !inexact++)
+            printf("  (%d,%d) clipped to (%d,%d)\n", cx, cy, ex[i], ey[i]);
+#endif
+        }
+        accelBlock(vx, vy, jx, jy, 61, ax, ay);
+        for (uint8_t i = 0; i < 61; i++) {
+          if ((vx[i] != ex[i]) || (vy[i] != ey[i])) {
+            if (!mismatches++) {
+              printf("  (%d,%d) accel (%d,%d): got (%d,%d), expected "
+                     "(%d,%d)\n",
+                     x0 + i, y, ax, ay, vx[i], vy[i], ex[i], ey[i]);
+            }
+          }
+        }
+      }
+    }
+  }
+  if (mismatches)
+    printf("  %u mismatches\n", (unsigned)mismatches);
+  if (inexact)
+    printf("  %u inexact\n", (unsigned)inexact);
+  return !mismatches && !inexact;
+}
+
+// Sets a scattering of obstacle pixels (a few short walls and dots),
+// recording them in obstacles[] (w * h elements) for checkState().
+static void addObstacles(Adafruit_PixelDust &sand, dimension_t w,
+                         dimension_t h, uint8_t *obstacles) {
+  for (uint32_t p = 0; p < (uint32_t)w * h; p++) {
+    dimension_t x = p % w, y = p / w;
+    obstacles[p] = !(p % 53) || ((y == h / 3) && (x % 16 < 6)) ||
+                   ((x == w / 2) && (y % 12 < 4));
+    if (obstacles[p])
+      sand.setPixel(x, y);
+  }
+}
+
+// Whole-state consistency check, used after the operations that touch
+// the bitmap or grain positions.  Every grain must be on the playfield,
+// the bitmap must hold exactly the obstacles plus one grain per set pixel
+// (no grain lost, doubled up, or on top of an obstacle), and
+// getGrainAt() and countFree() must agree with all of that.
+static bool checkState(const Adafruit_PixelDust &sand, dimension_t w,
+                       dimension_t h, grain_count_t n,
+                       const uint8_t *obstacles) {
+  grain_count_t *at =
+      (grain_count_t *)malloc((uint32_t)w * h * sizeof(grain_count_t));
+  bool ok = (at != NULL);
+  for (uint32_t p = 0; ok && (p < (uint32_t)w * h); p++)
+    at[p] = obstacles[p] ? PIXELDUST_OBSTACLE : PIXELDUST_EMPTY;
+  for (grain_count_t i = 0; ok && (i < n); i++) {
+    dimension_t x, y;
+    sand.getPosition(i, &x, &y);
+    if ((x >= w) || (y >= h)) {
+      printf("  grain %u off playfield at (%u,%u)\n", i, x, y);
+      ok = false;
+    } else if (at[y * w + x] != PIXELDUST_EMPTY) {
+      printf("  grain %u at (%u,%u) overlaps another grain or obstacle\n",
+             i, x, y);
+      ok = false;
+    } else {
+      at[y * w + x] = i;
+    }
+  }
+  uint32_t empty = 0;
+  for (uint32_t p = 0; ok && (p < (uint32_t)w * h); p++) {
+    dimension_t x = p % w, y = p / w;
+    empty += (at[p] == PIXELDUST_EMPTY);
+    if (sand.getPixel(x, y) != (at[p] != PIXELDUST_EMPTY)) {
+      printf("  bitmap wrong at (%u,%u)\n", x, y);
+      ok = false;
+    } else if (sand.getGrainAt(x, y) != at[p]) {
+      printf("  (%u,%u) is %u, expected %u\n", x, y, sand.getGrainAt(x, y),
+             at[p]);
+      ok = false;
+    }
+  }
+  if (ok && (sand.countFree() != empty)) {
+    printf("  %u pixels free, expected %u\n", (unsigned)sand.countFree(),
+           (unsigned)empty);
+    ok = false;
+  }
+  free(at);
+  return ok;
+}
+
+// Gravity directions (a full turn in 8 steps, scale 1 so 8000 is about
+// 31 units per frame) used to stir grains around in the tests below
+static const int16_t stir[][2] = {
+    {0, 8000},  {5600, 5600},   {8000, 0},  {5600, -5600},
+    {0, -8000}, {-5600, -5600}, {-8000, 0}, {-5600, 5600}};
+
+// Threaded iterate() moves bands of grains concurrently, even bands then
+// odd, so grains crossing band edges are the risk: check that none are
+// lost or doubled, and the grain map keeps up, with gravity turning
+// through every direction (and a shake now and then).  Once unsorted
+// without the map, once sorted with it.
+static bool testThreads(void) {
+  const dimension_t w = 64, h = 48;
+  static uint8_t obstacles[w * h];
+  for (uint8_t sort = 0; sort < 2; sort++) {
+    Adafruit_PixelDust sand(w, h, 1200, 1, 128, sort);
+    if (!sand.begin())
+      return false;
+    addObstacles(sand, w, h, obstacles);
+    if (!sand.setThreads(4) || (sort && !sand.enableGrainMap()))
+      return false;
+    sand.randomize();
+    for (uint16_t f = 0; f < 400; f++) {
+      sand.iterate(stir[f / 25 % 8][0], stir[f / 25 % 8][1],
+                   (f % 50 < 3) ? 20000 : 0);
+      if (!checkState(sand, w, h, 1200, obstacles)) {
+        printf("  sort %u, frame %u\n", sort, f);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Grain map must tell an obstacle at (0,0) apart from grains that haven't
+// been placed yet, which also report position (0,0).  Checks the map, and
+// the search used without one, after randomize() and after placing a
+// grain on (0,0) itself, and that iterate() leaves unplaced grains out
+// rather than moving them from (0,0) onto the playfield.
+static bool checkGrainAt(Adafruit_PixelDust &sand, grain_count_t n,
+                         grain_count_t at00) {
+  bool ok = true;
+  if (sand.getGrainAt(0, 0) != at00) {
+    printf("  (0,0) is %u, expected %u\n", sand.getGrainAt(0, 0), at00);
+    ok = false;
+  }
+  for (grain_count_t i = 0; i < n; i++) {
+    dimension_t x, y;
+    sand.getPosition(i, &x, &y);
+    if (sand.getGrainAt(x, y) != i) {
+      printf("  grain %u at (%u,%u) maps to %u\n", i, x, y,
+             sand.getGrainAt(x, y));
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+static bool testGrainMap(void) {
+  bool ok = true;
+  for (uint8_t map = 0; map < 2; map++) {
+    Adafruit_PixelDust sand(8, 8, 20, 1);
+    if (!sand.begin())
+      return false;
+    sand.setPixel(0, 0);
+    if (map && !sand.enableGrainMap())
+      return false;
+    if (sand.getGrainAt(0, 0) != PIXELDUST_OBSTACLE) {
+      printf("  (0,0) not an obstacle before randomize()\n");
+      ok = false;
+    }
+    sand.randomize();
+    ok &= checkGrainAt(sand, 20, PIXELDUST_OBSTACLE);
+
+    Adafruit_PixelDust sand2(8, 8, 20, 1);
+    if (!sand2.begin())
+      return false;
+    sand2.setPosition(5, 0, 0);
+    if (map && !sand2.enableGrainMap())
+      return false;
+    ok &= checkGrainAt(sand2, 0, 5);
+
+    static const uint8_t obstacles[64] = {1}; // Just (0,0)
+    Adafruit_PixelDust sand3(8, 8, 20, 1);
+    if (!sand3.begin())
+      return false;
+    sand3.setPixel(0, 0);
+    sand3.setPosition(0, 3, 2);
+    if (map && !sand3.enableGrainMap())
+      return false;
+    for (uint8_t f = 0; f < 10; f++)
+      sand3.iterate(0, 8000);
+    ok &= checkState(sand3, 8, 8, 1, obstacles);
+  }
+  return ok;
+}
+
+// render() must draw only placed grains (unplaced ones report position
+// (0,0), see testGrainMap()) and obstacles, nothing else.
+static bool testRender(void) {
+  Adafruit_PixelDust sand(8, 8, 20, 1);
+  uint8_t buf[64];
+  if (!sand.begin())
+    return false;
+  sand.setPixel(7, 7);
+  sand.setPosition(4, 3, 2);
+  memset(buf, 0, sizeof buf);
+  sand.render(buf, PIXELDUST_GRAY8, NULL, 0, 0x404040);
+  bool ok = true;
+  for (uint8_t p = 0; p < 64; p++) {
+    if (!buf[p] != ((p != 2 * 8 + 3) && (p != 7 * 8 + 7))) {
+      printf("  pixel (%u,%u) is %u\n", p % 8, p / 8, buf[p]);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// With gravity (dx,dy) along one axis, true if every grain is blocked
+// in that direction by another grain, an obstacle or the edge, as every
+// grain should be once the field has settled.  A grain over a gap means
+// it fell asleep too soon or wasn't woken.
+static bool checkSettled(const Adafruit_PixelDust &sand, dimension_t w,
+                         dimension_t h, grain_count_t n, int8_t dx,
+                         int8_t dy) {
+  for (grain_count_t i = 0; i < n; i++) {
+    dimension_t x, y;
+    sand.getPosition(i, &x, &y);
+    int32_t nx = x + dx, ny = y + dy;
+    if ((nx >= 0) && (nx < w) && (ny >= 0) && (ny < h) &&
+        !sand.getPixel(nx, ny)) {
+      printf("  grain %u at (%u,%u) over empty pixel\n", i, x, y);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Sleeping grains must wake when a pixel beside them is vacated or
+// gravity turns.  Lets a field settle (checking that most grains are
+// then asleep), opens a gap in an obstacle wall under a pile, then turns
+// gravity sideways, checking after each that no grain is left hanging
+// and the state stays consistent throughout.
+static bool testSleep(void) {
+  const dimension_t w = 64, h = 48;
+  const grain_count_t n = 1200;
+  static uint8_t obstacles[w * h];
+  Adafruit_PixelDust sand(w, h, n, 1);
+  if (!sand.begin())
+    return false;
+  addObstacles(sand, w, h, obstacles);
+  if (!sand.enableSleep(4))
+    return false;
+  sand.randomize();
+  for (uint8_t phase = 0; phase < 3; phase++) {
+    if (phase == 1) { // Open the wall at h / 3
+      for (dimension_t x = 0; x < w; x++) {
+        if ((x % 16 < 6) && (((uint32_t)h / 3 * w + x) % 53)) {
+          sand.clearPixel(x, h / 3);
+          obstacles[h / 3 * w + x] = 0;
+        }
+      }
+    }
+    int16_t ax = (phase == 2) ? 8000 : 0, ay = (phase == 2) ? 0 : 8000;
+    for (uint16_t f = 0; f < 300; f++) {
+      sand.iterate(ax, ay);
+      if (!checkState(sand, w, h, n, obstacles)) {
+        printf("  phase %u, frame %u\n", phase, f);
+        return false;
+      }
+    }
+    if (!checkSettled(sand, w, h, n, ax ? 1 : 0, ay ? 1 : 0))
+      return false;
+    if (sand.getActiveCount() > n / 4) {
+      printf("  phase %u: %u grains still awake\n", phase,
+             sand.getActiveCount());
+      return false;
+    }
+  }
+
+  // Sleep state is in snapshots: a restored copy must carry on exactly as
+  // the original, and one with a corrupt active list (wrong length) must
+  // wake everything instead
+  size_t size = sand.getSnapshotSize();
+  uint8_t *snap = (uint8_t *)malloc(size);
+  if (!snap || !sand.saveSnapshot(snap, size))
+    return false;
+  Adafruit_PixelDust copy(w, h, n, 1), bad(w, h, n, 1);
+  bool ok = copy.begin() && copy.enableSleep(4) &&
+            copy.restoreSnapshot(snap, size) &&
+            (copy.getActiveCount() == sand.getActiveCount());
+  for (uint16_t f = 0; ok && (f < 100); f++) {
+    sand.iterate(stir[f / 4 % 8][0], stir[f / 4 % 8][1]);
+    copy.iterate(stir[f / 4 % 8][0], stir[f / 4 % 8][1]);
+    if (sand.getHash() != copy.getHash()) {
+      printf("  restored copy differs, frame %u\n", f);
+      ok = false;
+    }
+  }
+  snap[size - restBytes(n)] ^= 1; // Active list length, low byte
+  if (ok && (!bad.begin() || !bad.enableSleep(4) ||
+             !bad.restoreSnapshot(snap, size) ||
+             (bad.getActiveCount() != n))) {
+    printf("  corrupt active list used\n");
+    ok = false;
+  }
+  free(snap);
+  return ok;
+}
+
+// advance() merges its steps' change lists into one.  Replaying each
+// call's list from the prior positions must give the new positions, with
+// every entry starting where its grain was, none that start and end on
+// the same pixel, and grains not listed unmoved.  Also checks that steps
+// taken add up to the time passed in.
+static bool testAdvanceChanges(void) {
+  const dimension_t w = 48, h = 32;
+  const grain_count_t n = 500;
+  static uint8_t obstacles[w * h];
+  static dimension_t xy[n * 2];
+  Adafruit_PixelDust sand(w, h, n, 1);
+  if (!sand.begin())
+    return false;
+  addObstacles(sand, w, h, obstacles);
+  if (!sand.enableChanges())
+    return false;
+  sand.setStep(10000, 8);
+  sand.randomize();
+  for (grain_count_t i = 0; i < n; i++)
+    sand.getPosition(i, &xy[i * 2], &xy[i * 2 + 1]);
+  uint32_t elapsed = 0, steps = 0;
+  for (uint16_t f = 0; f < 200; f++) {
+    uint32_t t = 3000 + (f * 7919) % 75000; // 0 to 7 steps' worth
+    elapsed += t;
+    steps += sand.advance(t, stir[f / 25 % 8][0], stir[f / 25 % 8][1]);
+    const GrainChange *c = sand.getChanges();
+    for (grain_count_t k = 0; k < sand.getChangeCount(); k++, c++) {
+      dimension_t *p = &xy[c->grain * 2];
+      if ((c->oldX != p[0]) || (c->oldY != p[1]) ||
+          ((c->newX == c->oldX) && (c->newY == c->oldY))) {
+        printf("  frame %u: grain %u at (%u,%u) listed (%u,%u) to (%u,%u)\n",
+               f, c->grain, p[0], p[1], c->oldX, c->oldY, c->newX, c->newY);
+        return false;
+      }
+      p[0] = c->newX;
+      p[1] = c->newY;
+    }
+    for (grain_count_t i = 0; i < n; i++) {
+      dimension_t x, y;
+      sand.getPosition(i, &x, &y);
+      if ((x != xy[i * 2]) || (y != xy[i * 2 + 1])) {
+        printf("  frame %u: grain %u at (%u,%u), replay has (%u,%u)\n", f,
+               i, x, y, xy[i * 2], xy[i * 2 + 1]);
+        return false;
+      }
+    }
+    if (!checkState(sand, w, h, n, obstacles))
+      return false;
+  }
+  if (steps != elapsed / 10000) {
+    printf("  %u steps for %u us\n", (unsigned)steps, (unsigned)elapsed);
+    return false;
+  }
+  return true;
+}
+
+// blit() and fillRect() work a word at a time with partial words at
+// each end, so widths, offsets and clipping are the risk.  First on an
+// empty grid against a byte-per-pixel model, every op with masks hanging
+// off each edge and padded rows; then among settling grains (sleeping,
+// so the grain map and wakes are involved too), only ever setting empty
+// pixels or clearing obstacles, checking the whole state each time.
+static bool testBlit(void) {
+  const dimension_t w = 70, h = 40;
+  const grain_count_t n = 400;
+  static uint8_t obstacles[w * h], mask[9 * 24]; // Up to 60x24, padded
+  uint32_t r = 12345;
+  Adafruit_PixelDust sand(w, h, n, 1);
+  if (!sand.begin())
+    return false;
+
+  for (uint16_t k = 0; k < 600; k++) {
+    r ^= r << 13; // xorshift32
+    r ^= r >> 17;
+    r ^= r << 5;
+    dimension_t mw = 1 + r % 60, mh = 1 + (r >> 6) % 24;
+    int16_t x = (int16_t)((r >> 11) % (w + 40)) - 20,
+            y = (int16_t)((r >> 18) % (h + 20)) - 10;
+    uint8_t op = (r >> 25) % 5;
+    uint16_t stride = (mw + 7) / 8 + ((r >> 28) & 1);
+    if (op < 3) {
+      for (uint16_t b = 0; b < sizeof mask; b++)
+        mask[b] = (uint8_t)(r >> (b % 24)) ^ (uint8_t)(b * 37);
+      sand.blit(mask, mw, mh, x, y, (pixeldust_op_t)op, stride);
+    } else if ((x >= 0) && (y >= 0)) {
+      sand.fillRect(x, y, mw, mh, op == 3);
+    } else {
+      continue;
+    }
+    for (dimension_t my = 0; my < mh; my++) {
+      for (dimension_t mx = 0; mx < mw; mx++) {
+        int32_t px = x + mx, py = y + my;
+        if ((px < 0) || (px >= w) || (py < 0) || (py >= h))
+          continue;
+        uint8_t *o = &obstacles[py * w + px];
+        if (op >= 3)
+          *o = (op == 3);
+        else if ((mask[my * stride + mx / 8] << (mx % 8)) & 0x80)
+          *o = (op != PIXELDUST_ANDNOT);
+        else if (op == PIXELDUST_COPY)
+          *o = 0;
+      }
+    }
+    for (uint32_t p = 0; p < (uint32_t)w * h; p++) {
+      if (sand.getPixel(p % w, p / w) != obstacles[p]) {
+        printf("  op %u %ux%u at (%d,%d): (%u,%u) wrong\n", op, mw, mh, x,
+               y, (unsigned)(p % w), (unsigned)(p / w));
+        return false;
+      }
+    }
+  }
+
+  sand.clear();
+  memset(obstacles, 0, sizeof obstacles);
+  if (!sand.enableSleep(4))
+    return false;
+  sand.randomize();
+  for (uint16_t k = 0; k < 200; k++) {
+    for (uint8_t f = 0; f < 4; f++)
+      sand.iterate(stir[k / 25 % 8][0], stir[k / 25 % 8][1]);
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    dimension_t mw = 1 + r % 60, mh = 1 + (r >> 6) % 24;
+    int16_t x = (int16_t)((r >> 11) % (w + 40)) - 20,
+            y = (int16_t)((r >> 18) % (h + 20)) - 10;
+    pixeldust_op_t op = (r >> 25) & 1 ? PIXELDUST_ANDNOT : PIXELDUST_OR;
+    uint16_t stride = (mw + 7) / 8;
+    memset(mask, 0, sizeof mask);
+    for (dimension_t my = 0; my < mh; my++) {
+      for (dimension_t mx = 0; mx < mw; mx++) {
+        int32_t px = x + mx, py = y + my;
+        bool in = (px >= 0) && (px < w) && (py >= 0) && (py < h);
+        // Set only empty pixels, clear only obstacles
+        if (in && ((op == PIXELDUST_OR) ? sand.getPixel(px, py)
+                                        : !obstacles[py * w + px]))
+          continue;
+        if ((r >> ((mx + my) % 24)) & 1) {
+          mask[my * stride + mx / 8] |= 0x80 >> (mx % 8);
+          if (in)
+            obstacles[py * w + px] = (op == PIXELDUST_OR);
+        }
+      }
+    }
+    sand.blit(mask, mw, mh, x, y, op);
+    if (!checkState(sand, w, h, n, obstacles)) {
+      printf("  op %u %ux%u at (%d,%d)\n", op, mw, mh, x, y);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Snapshots with grains off the playfield, on a clear pixel or faster
+// than terminal velocity must be rejected by both restoreSnapshot() and
+// attachSnapshot(), which could otherwise index outside the bitmap.
+// Corrupts grain 0 of a good snapshot (SOA layout: X, Y, VX, VY arrays
+// after the header and bitmap) in each of these ways.
+static bool testSnapshotChecks(void) {
+  Adafruit_PixelDust sand(40, 30, 100, 1);
+  if (!sand.begin())
+    return false;
+  sand.randomize();
+  size_t size = sand.getSnapshotSize();
+  uint8_t *good = (uint8_t *)malloc(size), *bad = (uint8_t *)malloc(size);
+  if (!good || !bad || !sand.saveSnapshot(good, size))
+    return false;
+  size_t grains = size - pad8(100 * GRAIN_BYTES);
+  position_t *x = (position_t *)&bad[grains], *y = &x[100];
+  velocity_t *vx = (velocity_t *)&y[100], *vy = &vx[100];
+  dimension_t px, py;
+  sand.getPosition(0, &px, &py);
+  bool ok = true;
+
+  for (uint8_t t = 0; t < 8; t++) {
+    memcpy(bad, good, size);
+    switch (t) {
+    case 1:
+      x[0] = 40 * 256;
+      break;
+    case 2:
+      y[0] = -1;
+      break;
+    case 3:
+      x[0] = -2;
+      break;
+    case 4:
+      vx[0] = 257;
+      break;
+    case 5:
+      vy[0] = -300;
+      break;
+    case 6: // Move grain 0 to a clear pixel
+      for (dimension_t j = 0; j < 40; j++) {
+        if (!sand.getPixel(j, 0)) {
+          x[0] = j * 256;
+          y[0] = 0;
+          break;
+        }
+      }
+      break;
+    case 7: { // Clear grain 0's pixel in the bitmap
+      uint8_t *p = &bad[sizeof(SnapshotHeader) +
+                        (py * ((40 + PIXELDUST_WORD_BITS - 1) /
+                               PIXELDUST_WORD_BITS) +
+                         px / PIXELDUST_WORD_BITS) *
+                            sizeof(bitmap_word_t)];
+      bitmap_word_t w;
+      memcpy(&w, p, sizeof w);
+      w &= ~((bitmap_word_t)1
+             << (PIXELDUST_WORD_BITS - 1 - px % PIXELDUST_WORD_BITS));
+      memcpy(p, &w, sizeof w);
+      break;
+    }
+    }
+    Adafruit_PixelDust load(40, 30, 100, 1);
+    bool restored = load.restoreSnapshot(bad, size),
+         attached = load.attachSnapshot(bad, size);
+#ifdef PIXELDUST_SPARSE
+    attached = !t; // attachSnapshot() not available, always fails
+#endif
+    if ((restored != !t) || (attached != !t)) {
+      printf("  case %u: restore %d, attach %d\n", t, restored, attached);
+      ok = false;
+    }
+  }
+  free(good);
+  free(bad);
+
+  // A sorted order that isn't a permutation (one grain twice, another
+  // missing) must be ignored, same as a snapshot without one
+  Adafruit_PixelDust sorted(40, 30, 100, 1, 128, true);
+  if (!sorted.begin())
+    return false;
+  sorted.randomize();
+  for (uint8_t f = 0; f < 20; f++)
+    sorted.iterate(stir[f % 8][0], stir[f % 8][1]);
+  size = sorted.getSnapshotSize();
+  good = (uint8_t *)malloc(size);
+  bad = (uint8_t *)malloc(size);
+  if (!good || !bad || !sorted.saveSnapshot(good, size))
+    return false;
+  memcpy(bad, good, size);
+  memcpy(&bad[size - 4], &bad[size - 8], 4); // Last entry = next-to-last
+  good[offsetof(SnapshotHeader, layout)] &= ~SNAPSHOT_ORDER;
+  Adafruit_PixelDust a(40, 30, 100, 1, 128, true),
+      b(40, 30, 100, 1, 128, true);
+  if (!a.restoreSnapshot(good, size) || !b.restoreSnapshot(bad, size))
+    ok = false;
+  for (uint8_t f = 0; ok && (f < 20); f++) {
+    a.iterate(stir[f % 8][0], stir[f % 8][1]);
+    b.iterate(stir[f % 8][0], stir[f % 8][1]);
+    if (a.getHash() != b.getHash()) {
+      printf("  corrupt order used, frame %u\n", f);
+      ok = false;
+    }
+  }
+  free(good);
+  free(bad);
+  return ok;
+}
+
+// Sorting reorders an index list, not the grains, so each grain must keep
+// its identity: replaying each frame's change list from the previous
+// positions must give the new ones.  The list itself, as saved in
+// snapshots, must hold every grain once, in descending order along the
+// sort direction of the positions it was sorted on (those at the end of
+// the frame before).  Gravity wobbles within an octant for a while
+// (incremental repair of the order), turns to the next (full rebuild) and
+// shakes now and then (too far out of order to repair).
+static bool testSort(void) {
+  const dimension_t w = 96, h = 40;
+  const grain_count_t n = 1500;
+  static uint8_t obstacles[w * h], seen[n];
+  static dimension_t xy[n * 2];
+  Adafruit_PixelDust sand(w, h, n, 1, 128, true);
+  if (!sand.begin())
+    return false;
+  addObstacles(sand, w, h, obstacles);
+  if (!sand.enableChanges())
+    return false;
+  sand.randomize();
+  for (grain_count_t i = 0; i < n; i++)
+    sand.getPosition(i, &xy[i * 2], &xy[i * 2 + 1]);
+  size_t size = sand.getSnapshotSize(), list = size - pad8((size_t)n * 4),
+         grains = list - pad8((size_t)n * GRAIN_BYTES);
+  uint8_t *prev = (uint8_t *)malloc(size), *cur = (uint8_t *)malloc(size);
+  if (!prev || !cur || !sand.saveSnapshot(prev, size))
+    return false;
+  bool ok = true;
+  for (uint16_t f = 0; ok && (f < 480); f++) {
+    const int16_t *g = stir[f / 60 % 8];
+    int16_t wobble = (f % 7 - 3) * 300;
+    sand.iterate(g[0] + (g[1] ? wobble : 0), g[1] + (g[0] ? 0 : wobble),
+                 (f % 60 == 40) ? 20000 : 0);
+    const GrainChange *c = sand.getChanges();
+    for (grain_count_t k = 0; ok && (k < sand.getChangeCount()); k++, c++) {
+      dimension_t *p = &xy[c->grain * 2];
+      if ((c->oldX != p[0]) || (c->oldY != p[1])) {
+        printf("  frame %u: grain %u at (%u,%u) listed from (%u,%u)\n", f,
+               c->grain, p[0], p[1], c->oldX, c->oldY);
+        ok = false;
+      }
+      p[0] = c->newX;
+      p[1] = c->newY;
+    }
+    for (grain_count_t i = 0; ok && (i < n); i++) {
+      dimension_t x, y;
+      sand.getPosition(i, &x, &y);
+      if ((x != xy[i * 2]) || (y != xy[i * 2 + 1])) {
+        printf("  frame %u: grain %u at (%u,%u), replay has (%u,%u)\n", f,
+               i, x, y, xy[i * 2], xy[i * 2 + 1]);
+        ok = false;
+      }
+    }
+    if (!ok || !checkState(sand, w, h, n, obstacles) ||
+        !sand.saveSnapshot(cur, size)) {
+      printf("  frame %u\n", f);
+      ok = false;
+      break;
+    }
+    // Order (SOA layout: X then Y arrays) against previous positions
+    const position_t *px = (const position_t *)&prev[grains], *py = &px[n];
+    const int8_t *d = sortDir[cur[offsetof(SnapshotHeader, sortOctant)]];
+    int32_t last = INT32_MAX;
+    memset(seen, 0, sizeof seen);
+    for (grain_count_t k = 0; ok && (k < n); k++) {
+      uint32_t i;
+      memcpy(&i, &cur[list + k * 4], 4);
+      int32_t key = (i < n) ? (int32_t)px[i] * d[0] + (int32_t)py[i] * d[1]
+                            : 0;
+      if ((i >= n) || seen[i]++ || (key > last)) {
+        printf("  frame %u: order[%u] is %u\n", f, k, (unsigned)i);
+        ok = false;
+      }
+      last = key;
+    }
+    uint8_t *t = prev;
+    prev = cur;
+    cur = t;
+  }
+  free(prev);
+  free(cur);
+  return ok;
+}
+
+#ifdef PIXELDUST_THREADS
+// Runner frames must put unplaced grains off the playfield, where
+// bounds-checked drawing skips them, rather than at (0,0), both in the
+// first frame and ones the runner has simulated.
+static bool testRunnerFrame(void) {
+  Adafruit_PixelDust sand(8, 8, 20, 1);
+  if (!sand.begin())
+    return false;
+  sand.setPosition(4, 3, 2);
+  if (!sand.startRunner(1000))
+    return false;
+  const GrainFrame *f = sand.getFrame();
+  bool ok = true;
+  for (uint8_t k = 0; ok && (k < 2); k++) {
+    if (k) { // Wait for a few simulated frames
+      struct timespec t = {0, 1000000};
+      while ((f = sand.getFrame())->frame < 5)
+        nanosleep(&t, NULL);
+    }
+    for (grain_count_t i = 0; i < 20; i++) {
+      if ((i != 4) ? ((f->xy[i * 2] < 8) || (f->xy[i * 2 + 1] < 8))
+                   : ((f->xy[i * 2] >= 8) || (f->xy[i * 2 + 1] >= 8))) {
+        printf("  frame %u: grain %u at (%u,%u)\n", (unsigned)f->frame, i,
+               f->xy[i * 2], f->xy[i * 2 + 1]);
+        ok = false;
+      }
+    }
+  }
+  sand.stopRunner();
+  return ok;
+}
+#endif
+
+// Brute-force counterparts of countFree() and findFree(), from getPixel()
+static uint32_t freePixels(const Adafruit_PixelDust &sand, dimension_t w,
+                           dimension_t h, dimension_t x0, dimension_t y0,
+                           dimension_t rw, dimension_t rh) {
+  uint32_t n = 0;
+  for (uint32_t y = y0; (y < (uint32_t)y0 + rh) && (y < h); y++) {
+    for (uint32_t x = x0; (x < (uint32_t)x0 + rw) && (x < w); x++)
+      n += !sand.getPixel(x, y);
+  }
+  return n;
+}
+
+static uint32_t nearestFree(const Adafruit_PixelDust &sand, dimension_t w,
+                            dimension_t h, dimension_t x0, dimension_t y0) {
+  uint32_t best = 0xFFFFFFFF;
+  for (int32_t y = 0; y < h; y++) {
+    for (int32_t x = 0; x < w; x++) {
+      uint32_t d = (x - x0) * (x - x0) + (y - y0) * (y - y0);
+      if ((d < best) && !sand.getPixel(x, y))
+        best = d;
+    }
+  }
+  return best;
+}
+
+// The tile summary is updated incrementally by everything that sets or
+// clears pixels, so check countFree(), isEmpty() and findFree() against
+// brute force over random rectangles and points (on a grid that's not a
+// whole number of tiles, with several summary levels) as grains move and
+// obstacles come and go.  Also randomize() through the summary, into a
+// nearly full grid.
+static bool testTiles(void) {
+  const dimension_t w = 100, h = 70;
+  const grain_count_t n = 5200;
+  static uint8_t obstacles[w * h];
+  uint32_t r = 54321;
+  Adafruit_PixelDust sand(w, h, n, 1);
+  if (!sand.begin())
+    return false;
+  addObstacles(sand, w, h, obstacles);
+  if (!sand.enableTiles())
+    return false;
+  sand.randomize();
+  if (!checkState(sand, w, h, n, obstacles))
+    return false;
+  for (uint16_t f = 0; f < 300; f++) {
+    sand.iterate(stir[f / 25 % 8][0], stir[f / 25 % 8][1],
+                 (f % 50 < 3) ? 20000 : 0);
+    r ^= r << 13; // xorshift32
+    r ^= r >> 17;
+    r ^= r << 5;
+    dimension_t x = r % w, y = (r >> 8) % h, rw = 1 + (r >> 16) % 40,
+                rh = 1 + (r >> 24) % 40;
+    if (f % 30 == 10) { // Clear obstacles in a rectangle
+      for (uint32_t p = 0; p < (uint32_t)w * h; p++) {
+        if (obstacles[p] && (p % w >= x) && (p % w < x + rw) &&
+            (p / w >= y) && (p / w < y + rh)) {
+          sand.clearPixel(p % w, p / w);
+          obstacles[p] = 0;
+        }
+      }
+    } else if (f % 30 == 20) { // Add obstacles on free pixels
+      for (dimension_t k = 0; k < 50; k++) {
+        dimension_t px = (x + k * 7) % w, py = (y + k * 3) % h;
+        if (!sand.getPixel(px, py)) {
+          sand.setPixel(px, py);
+          obstacles[py * w + px] = 1;
+        }
+      }
+    }
+    uint32_t expect = freePixels(sand, w, h, x, y, rw, rh),
+             total = freePixels(sand, w, h, 0, 0, w, h),
+             area = (uint32_t)((rw < w - x) ? rw : w - x) *
+                    ((rh < h - y) ? rh : h - y); // On the grid
+    dimension_t fx = 0, fy = 0;
+    bool found = sand.findFree(x, y, &fx, &fy);
+    uint32_t d = (uint32_t)(fx - x) * (fx - x) + (uint32_t)(fy - y) * (fy - y);
+    if ((sand.countFree(x, y, rw, rh) != expect) ||
+        (sand.isEmpty(x, y, rw, rh) != (expect == area)) ||
+        (sand.countFree() != total) || (found != (total > 0)) ||
+        (found && (sand.getPixel(fx, fy) ||
+                   (d != nearestFree(sand, w, h, x, y))))) {
+      printf("  frame %u: %ux%u at (%u,%u): %u free (expected %u), %u in "
+             "all (%u), nearest (%u,%u)\n",
+             f, rw, rh, x, y, (unsigned)sand.countFree(x, y, rw, rh),
+             (unsigned)expect, (unsigned)sand.countFree(), (unsigned)total,
+             fx, fy);
+      return false;
+    }
+    if (!checkState(sand, w, h, n, obstacles))
+      return false;
+  }
+  return true;
+}
+
+#ifdef PIXELDUST_SPARSE
+// Blocks that are all empty or all obstacle share one copy of each, so
+// the first write to one must get it a copy of its own rather than change
+// every block sharing it.  Fills two blocks (sharing the all-set copy),
+// clears a pixel in one and sets one in an empty block, then moves grains
+// through empty blocks, checking state throughout and that
+// compactBitmap() keeps exactly the blocks that are neither empty nor
+// full (blocks past the grid edge never count as full).  Run with
+// "make check PIXELDUST_FLAGS=-DPIXELDUST_SPARSE" (after 'make clean').
+static bool testSparse(void) {
+  const dimension_t w = 200, h = 150;
+  const grain_count_t n = 3000;
+  static uint8_t obstacles[w * h];
+  const dimension_t cols = (w + 63) / 64, rows = (h + 63) / 64;
+  Adafruit_PixelDust sand(w, h, n, 1);
+  if (!sand.begin())
+    return false;
+  sand.fillRect(0, 64, 128, 64);
+  for (dimension_t y = 64; y < 128; y++)
+    memset(&obstacles[y * w], 1, 128);
+  sand.clearPixel(70, 70);
+  obstacles[70 * w + 70] = 0;
+  sand.setPixel(10, 10);
+  obstacles[10 * w + 10] = 1;
+  if (!checkState(sand, w, h, 0, obstacles) || !sand.enableGrainMap())
+    return false;
+  sand.randomize();
+  for (uint16_t f = 0; f <= 400; f++) {
+    if (!(f % 10) && !checkState(sand, w, h, n, obstacles)) {
+      printf("  frame %u\n", f);
+      return false;
+    }
+    if (!(f % 50)) {
+      size_t expect = 2 * BLOCK_BYTES + cols * rows * sizeof(bitmap_word_t *);
+      for (uint32_t b = 0; b < (uint32_t)cols * rows; b++) {
+        uint32_t x0 = b % cols * 64, y0 = b / cols * 64, set = 0;
+        for (uint32_t y = y0; (y < y0 + 64) && (y < h); y++) {
+          for (uint32_t x = x0; (x < x0 + 64) && (x < w); x++)
+            set += sand.getPixel(x, y);
+        }
+        if (set && (set < 64 * 64))
+          expect += BLOCK_BYTES;
+      }
+      size_t bytes = sand.compactBitmap();
+      if (bytes != expect) {
+        printf("  frame %u: %u bytes in use, expected %u\n", f,
+               (unsigned)bytes, (unsigned)expect);
+        return false;
+      }
+    }
+    sand.iterate(stir[f / 50 % 8][0], stir[f / 50 % 8][1]);
+  }
+  return true;
+}
+#endif
+
+static const struct {
+  const char *name;
+  bool (*func)(void);
+} tests[] = {
+    {"accelBlock", testAccelBlock},
+    {"threads", testThreads},
+    {"grainMap", testGrainMap},
+    {"render", testRender},
+    {"sleep", testSleep},
+    {"advanceChanges", testAdvanceChanges},
+    {"blit", testBlit},
+    {"snapshotChecks", testSnapshotChecks},
+    {"sort", testSort},
+#ifdef PIXELDUST_THREADS
+    {"runnerFrame", testRunnerFrame},
+#endif
+    {"tiles", testTiles},
+#ifdef PIXELDUST_SPARSE
+    {"sparse", testSparse},
+#endif
+};
+
+int main(void) {
+  uint8_t failed = 0;
+  for (uint8_t t = 0; t < sizeof tests / sizeof tests[0]; t++) {
+    bool ok = tests[t].func();
+    printf("%s: %s\n", tests[t].name, ok ? "ok" : "FAILED");
+    if (!ok)
+      failed++;
+  }
+  return failed ? 1 : 0;
+}
+
+#endif // !ARDUINO
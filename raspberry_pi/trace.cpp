@@ -0,0 +1,98 @@
+/*!
+ * @file trace.cpp
+ *
+ * Reading and writing accelerometer input traces, see trace.h.
+ *
+ */
+
+#ifndef ARDUINO // Arduino IDE sometimes aggressively builds subfolders
+
+#include "trace.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool traceLoad(trace_data_t *t, const char *filename) {
+  FILE *fp;
+  char line[128];
+  int x, y, z, n = 0, alloc = 0;
+  unsigned long s;
+
+  t->frames = NULL;
+  t->nFrames = 0;
+  t->seed = 1;
+  t->hasSeed = false;
+  if (!(fp = fopen(filename, "r")))
+    return false;
+  while (fgets(line, sizeof line, fp)) {
+    if (line[0] == '#') {
+      if (sscanf(line, "# seed %lu", &s) == 1) {
+        t->seed = s;
+        t->hasSeed = true;
+      }
+      continue;
+    }
+    if (sscanf(line, "%d %d %d", &x, &y, &z) != 3)
+      continue;
+    if (n >= alloc) {
+      alloc = alloc ? alloc * 2 : 1024;
+      int16_t(*f)[3] =
+          (int16_t(*)[3])realloc(t->frames, alloc * sizeof t->frames[0]);
+      if (!f) { // Out of memory, don't leak what's been read so far
+        fclose(fp);
+        traceFree(t);
+        return false;
+      }
+      t->frames = f;
+    }
+    t->frames[n][0] = x;
+    t->frames[n][1] = y;
+    t->frames[n][2] = z;
+    n++;
+  }
+  fclose(fp);
+  t->nFrames = n;
+  return n > 0;
+}
+
+void traceFree(trace_data_t *t) {
+  free(t->frames);
+  t->frames = NULL;
+  t->nFrames = 0;
+}
+
+FILE *traceCreate(const char *filename, uint32_t seed) {
+  FILE *fp = fopen(filename, "w");
+  if (fp)
+    fprintf(fp, "# Adafruit_PixelDust accelerometer trace: X Y Z per frame\n"
+                "# seed %lu\n",
+            (unsigned long)seed);
+  return fp;
+}
+
+void traceWrite(FILE *fp, int x, int y, int z) {
+  fprintf(fp, "%d %d %d\n", x, y, z);
+}
+
+bool traceSynthetic(const char *name, int frame, int *x, int *y, int *z) {
+  if (!strcmp(name, "spin")) {
+    double a = (double)frame * M_PI * 2.0 / 256.0;
+    *x = (int)(cos(a) * TRACE_GRAVITY);
+    *y = (int)(sin(a) * TRACE_GRAVITY);
+    *z = TRACE_GRAVITY / 2;
+  } else if (!strcmp(name, "shake")) {
+    // Mostly-down gravity with large random jolts
+    *x = rand() % (TRACE_GRAVITY * 4) - TRACE_GRAVITY * 2;
+    *y = rand() % (TRACE_GRAVITY * 4) - TRACE_GRAVITY;
+    *z = rand() % TRACE_GRAVITY;
+  } else if (!strcmp(name, "down")) {
+    *x = 0;
+    *y = TRACE_GRAVITY;
+    *z = 0;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+#endif // !ARDUINO
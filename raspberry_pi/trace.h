@@ -0,0 +1,80 @@
+/*!
+ * @file trace.h
+ *
+ * Header file to accompany trace.cpp -- accelerometer input traces, for
+ * recording (record.cpp) and replaying (bench.cpp) Adafruit_PixelDust
+ * runs.
+ *
+ * Traces are plain text, one frame per line, three integers (X, Y, Z) as
+ * passed to iterate().  Lines starting with '#' are comments, except for
+ * "# seed N" giving the random seed to replay with (see
+ * Adafruit_PixelDust::seed()).  There are also a few synthetic traces,
+ * generated on the fly (see traceSynthetic()).
+ *
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_GRAVITY 8192 ///< 1G on LIS3DH at +/- 4G range, as in demos
+
+/*!
+    @brief Accelerometer trace loaded from a file.
+*/
+typedef struct {
+  int16_t (*frames)[3]; ///< X/Y/Z accelerometer input per frame
+  int nFrames;          ///< Number of frames
+  uint32_t seed;        ///< Random seed from "# seed" line, if hasSeed
+  bool hasSeed;         ///< True if the trace gives a seed
+} trace_data_t;
+
+/*!
+    @brief  Load a trace file.
+    @param  t        Trace to fill in; free with traceFree() when done.
+    @param  filename Trace file name.
+    @return True on success, false if the file can't be read, holds no
+            frames, or memory could not be allocated.
+*/
+bool traceLoad(trace_data_t *t, const char *filename);
+
+/*!
+    @brief Free frame data allocated by traceLoad().
+    @param t Trace to free.
+*/
+void traceFree(trace_data_t *t);
+
+/*!
+    @brief  Create a trace file and write its header.
+    @param  filename Trace file name.
+    @param  seed     Random seed used with the recorded input.
+    @return File handle for traceWrite() (fclose() when done), or NULL
+            on error.
+*/
+FILE *traceCreate(const char *filename, uint32_t seed);
+
+/*!
+    @brief Append one frame to a trace file.
+    @param fp File handle from traceCreate().
+    @param x  Accelerometer X input, as passed to iterate().
+    @param y  Accelerometer Y input.
+    @param z  Accelerometer Z input.
+*/
+void traceWrite(FILE *fp, int x, int y, int z);
+
+/*!
+    @brief  Get one frame of a synthetic trace: "down" (steady gravity),
+            "spin" (gravity turns once every 256 frames, exercising every
+            sort direction) or "shake" (large random jolts, using rand()).
+    @param  name  Synthetic trace name.
+    @param  frame Frame number.
+    @param  x     Receives accelerometer X input, as passed to iterate().
+    @param  y     Receives accelerometer Y input.
+    @param  z     Receives accelerometer Z input.
+    @return True on success, false if name isn't a synthetic trace.
+*/
+bool traceSynthetic(const char *name, int frame, int *x, int *y, int *z);
+
+#endif // _TRACE_H_